@@ -0,0 +1,286 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#ifndef _BINNER_H
+#define _BINNER_H
+
+#include <algorithm>
+#include <bitset>
+#include <climits>
+#include <functional>
+#include <vector>
+#include "record.h"
+
+/*
+ * Temporal binning of a record stream, shared by timetag_bin and the
+ * benchmarks.
+ */
+
+/*
+ * bin record format
+ */
+struct bin_record {
+        int chan_n;
+        uint64_t start_time;
+        unsigned int count;
+        unsigned int lost;
+};
+
+/*
+ * With --zero-runs, chan_n of a run of empty bins has ZERO_RUN set and
+ * count gives the number of bins in the run, starting at start_time.
+ * Runs of more than UINT_MAX bins are given as several records.
+ */
+#define ZERO_RUN 0x100
+
+enum zero_bins { OMIT_ZEROS, WITH_ZEROS, ZERO_RUNS };
+
+struct input_channel {
+        int chan_n;
+        count_t bin_start;
+        unsigned int count;
+        unsigned int lost;      // IMPORTANT: This is not a count of lost photons, only
+                                //            potential sprees of lost photons
+        input_channel(int chan_n) :
+                chan_n(chan_n), bin_start(0), count(0), lost(0) { }
+};
+
+typedef std::function<void(count_t, bin_record)> bin_printer;
+
+/*
+ * Emit the bins closed by the arrival of a record at the given time. With
+ * with_lost, bins holding only lost records are emitted even when empty
+ * bins are omitted.
+ */
+inline void close_bins(std::vector<input_channel>& chans, count_t bin_length, uint64_t time,
+                const std::function<void(bin_record)>& print, zero_bins zeros=WITH_ZEROS,
+                bool with_lost=false) {
+        for (auto c=chans.begin(); c != chans.end(); c++) {
+                if (time >= (c->bin_start + bin_length)) {
+                        uint64_t new_bin_start = (time / bin_length) * bin_length;
+                        
+                        // First print photons in last bin
+                        struct bin_record rec = { c->chan_n, c->bin_start, c->count, c->lost };
+                        if (zeros != OMIT_ZEROS || c->count > 0 || (with_lost && c->lost > 0))
+                                print(rec);
+
+                        // Then print zero bins
+                        uint64_t zeros_start = c->bin_start + bin_length;
+                        if (zeros == WITH_ZEROS) {
+                                for (uint64_t t=zeros_start; t < new_bin_start; t += bin_length) {
+                                        struct bin_record rec = { c->chan_n, t, 0, 0 };
+                                        print(rec);
+                                }
+                        } else if (zeros == ZERO_RUNS) {
+                                // A run longer than count can hold is split into several
+                                uint64_t n = (new_bin_start - zeros_start) / bin_length;
+                                while (n > 0) {
+                                        unsigned int run = std::min<uint64_t>(n, UINT_MAX);
+                                        struct bin_record rec = { c->chan_n | ZERO_RUN, zeros_start, run, 0 };
+                                        print(rec);
+                                        zeros_start += run * bin_length;
+                                        n -= run;
+                                }
+                        }
+
+                        // Then start our new bin
+                        c->lost = 0;
+                        c->count = 0;
+                        c->bin_start = new_bin_start;
+                }
+        }
+}
+
+/*
+ * Bin a record, counting it in the channels whose bits are set in counted
+ */
+inline void handle_record(std::vector<input_channel>& chans, count_t bin_length, const record& r,
+                   uint32_t counted, const std::function<void(bin_record)>& print,
+                   zero_bins zeros=WITH_ZEROS, bool with_lost=false) {
+        close_bins(chans, bin_length, r.get_time(), print, zeros, with_lost);
+        for (auto c=chans.begin(); c != chans.end(); c++) {
+                if (r.get_lost_flag())
+                        c->lost++;
+                if (counted & (1 << c->chan_n))
+                        c->count++;
+        }
+}
+
+inline void handle_record(std::vector<input_channel>& chans, count_t bin_length, const record& r,
+                   const std::function<void(bin_record)>& print, zero_bins zeros=WITH_ZEROS,
+                   bool with_lost=false) {
+        uint32_t counted = r.get_type() == record::type::STROBE ? r.get_channels().to_ulong() : 0;
+        handle_record(chans, bin_length, r, counted, print, zeros, with_lost);
+}
+
+inline std::vector<input_channel> make_channels(uint64_t bin_start, int n_chans=4) {
+        std::vector<input_channel> chans;
+        for (int i=0; i<n_chans; i++) {
+                chans.push_back(input_channel(i));
+                chans.back().bin_start = bin_start;
+        }
+        return chans;
+}
+
+/*
+ * Bins a stream at several bin lengths at once.
+ *
+ * Only the lengths which are not a multiple of a shorter length are
+ * binned from records. The bins of the others are summed from those of
+ * the longest length they are a multiple of as the shorter bins close.
+ *
+ * With by_excitation, strobe photons are counted separately under each
+ * delta channel active at their arrival, in channel 4*DELTA + STROBE.
+ */
+class multi_binner {
+        struct level {
+                count_t bin_length;
+                int source;     // Level whose bins are summed, or -1 to bin records
+                bool summed;    // Whether another level sums our bins
+                std::vector<input_channel> chans;
+                std::function<void(bin_record)> emit;
+        };
+
+        std::vector<level> levels;      // In order of increasing bin length
+        bin_printer print;
+        zero_bins zeros;
+        bool by_excitation;
+        std::bitset<4> delta_state;
+
+        int n_chans() const { return by_excitation ? 16 : 4; }
+
+        // The channels a record is counted in
+        uint32_t counted(const record& r) {
+                if (r.get_type() == record::type::DELTA) {
+                        if (by_excitation)
+                                delta_state = r.get_channels();
+                        return 0;
+                }
+                uint32_t strobes = r.get_channels().to_ulong();
+                if (!by_excitation)
+                        return strobes;
+                uint32_t mask = 0;
+                for (int d=0; d<4; d++) {
+                        if (delta_state[d])
+                                mask |= strobes << (4*d);
+                }
+                return mask;
+        }
+
+        /*
+         * A summed level must see bins with lost records even when empty
+         * bins are omitted; these are only printed when they would have
+         * been otherwise.
+         */
+        void close(level& l, uint64_t time) {
+                close_bins(l.chans, l.bin_length, time, l.emit, zeros, l.summed);
+        }
+
+        void add_bin(level& l, const bin_record& b) {
+                close(l, b.start_time);
+                input_channel& c = l.chans[b.chan_n];
+                c.count += b.count;
+                c.lost += b.lost;
+        }
+
+public:
+        multi_binner(std::vector<count_t> bin_lengths, bin_printer print, zero_bins zeros,
+                     bool by_excitation=false)
+                : print(print), zeros(zeros), by_excitation(by_excitation)
+        {
+                std::sort(bin_lengths.begin(), bin_lengths.end());
+                bin_lengths.erase(std::unique(bin_lengths.begin(), bin_lengths.end()), bin_lengths.end());
+                for (auto w=bin_lengths.begin(); w != bin_lengths.end(); w++) {
+                        int source = -1;
+                        for (int i=levels.size()-1; i >= 0 && source < 0; i--) {
+                                if (*w % levels[i].bin_length == 0)
+                                        source = i;
+                        }
+                        levels.push_back({ *w, source, false, make_channels(0, n_chans()), NULL });
+                        if (source >= 0)
+                                levels[source].summed = true;
+                }
+
+                for (size_t i=0; i<levels.size(); i++) {
+                        levels[i].emit = [this, i](bin_record b) {
+                                if (this->zeros != OMIT_ZEROS || b.count > 0)
+                                        this->print(levels[i].bin_length, b);
+                                // Runs of empty bins add nothing to the sums
+                                if (b.chan_n & ZERO_RUN)
+                                        return;
+                                for (size_t j=i+1; j<levels.size(); j++) {
+                                        if (levels[j].source == (int) i)
+                                                add_bin(levels[j], b);
+                                }
+                        };
+                }
+        }
+
+        multi_binner(const multi_binner&) = delete;
+        multi_binner& operator=(const multi_binner&) = delete;
+
+        count_t max_bin_length() const { return levels.back().bin_length; }
+
+        // Whether each bin length divides the longest
+        bool nested() const {
+                for (auto l=levels.begin(); l != levels.end(); l++) {
+                        if (max_bin_length() % l->bin_length != 0)
+                                return false;
+                }
+                return true;
+        }
+
+        // Begin the first bins at the given time
+        void start(uint64_t time) {
+                for (auto l=levels.begin(); l != levels.end(); l++)
+                        l->chans = make_channels((time / l->bin_length) * l->bin_length, n_chans());
+        }
+
+        // Set the delta channel state in effect
+        void set_delta_state(std::bitset<4> state) { delta_state = state; }
+
+        // Whether a record at the given time closes a bin of the longest length
+        bool closes(uint64_t time) const {
+                const level& l = levels.back();
+                return time >= l.chans[0].bin_start + l.bin_length;
+        }
+
+        // Emit the bins closed by the passing of the given time
+        void advance(uint64_t time) {
+                for (auto l=levels.begin(); l != levels.end(); l++)
+                        close(*l, time);
+        }
+
+        void handle_record(const record& r) {
+                uint32_t mask = counted(r);
+                for (auto l=levels.begin(); l != levels.end(); l++) {
+                        if (l->source < 0)
+                                ::handle_record(l->chans, l->bin_length, r, mask, l->emit,
+                                                zeros, l->summed);
+                        else
+                                close(*l, r.get_time());
+                }
+        }
+};
+
+#endif
@@ -0,0 +1,141 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+
+#ifndef _BUFFER_POOL_H
+#define _BUFFER_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+ * A fixed pool of buffers, filled by one producer thread and taken in
+ * the same order by one consumer, which hands them on to be released
+ * later from any thread.
+ *
+ * This lets the consumer pass buffers to ZeroMQ without copying them,
+ * release() being a zmq free function. Buffers are used round-robin,
+ * skipping any still in use, so a buffer held by a slow message doesn't
+ * hold up the rest. The producer never waits: only when every buffer is
+ * in use is its data dropped and counted. The order in which buffers
+ * were filled is kept in a ring of their indices for the consumer.
+ */
+class buffer_pool {
+        enum state : uint8_t { FREE, FILLED, SENDING };
+
+        const size_t n_bufs, buf_size;
+        std::vector<uint8_t> storage;
+        std::vector<size_t> lengths;
+        std::unique_ptr<std::atomic<uint8_t>[]> states;
+        size_t head;                    // Buffer being filled
+        std::vector<size_t> order;      // Indices of filled buffers, in order
+        std::atomic<uint64_t> n_filled; // Written by the producer
+        uint64_t n_taken;               // Consumer only
+
+        std::atomic<uint64_t> in_use, high_water, exhausted, dropped, sent;
+
+public:
+        buffer_pool(size_t n_bufs, size_t buf_size)
+                : n_bufs(n_bufs), buf_size(buf_size),
+                  storage(n_bufs * buf_size), lengths(n_bufs),
+                  states(new std::atomic<uint8_t>[n_bufs]), head(0), order(n_bufs),
+                  n_filled(0), n_taken(0),
+                  in_use(0), high_water(0), exhausted(0), dropped(0), sent(0)
+        {
+                for (size_t i=0; i<n_bufs; i++)
+                        states[i] = FREE;
+        }
+
+        buffer_pool(const buffer_pool&) = delete;
+        buffer_pool& operator=(const buffer_pool&) = delete;
+
+        /*
+         * The next free buffer to fill with up to length bytes, or NULL if
+         * all are in use, in which case the data is counted as dropped.
+         * Producer only.
+         */
+        uint8_t* acquire(size_t length) {
+                for (size_t k=0; length <= buf_size && k < n_bufs; k++) {
+                        size_t i = (head + k) % n_bufs;
+                        if (states[i].load(std::memory_order_acquire) == FREE) {
+                                head = i;
+                                return &storage[head * buf_size];
+                        }
+                }
+                exhausted.fetch_add(1, std::memory_order_relaxed);
+                dropped.fetch_add(length, std::memory_order_relaxed);
+                return NULL;
+        }
+
+        // Pass the buffer returned by acquire() to the consumer. Producer only.
+        void commit(size_t length) {
+                lengths[head] = length;
+                uint64_t n = in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+                if (n > high_water.load(std::memory_order_relaxed))
+                        high_water.store(n, std::memory_order_relaxed);
+                states[head].store(FILLED, std::memory_order_relaxed);
+                // At most n_bufs buffers are filled and not yet taken
+                uint64_t f = n_filled.load(std::memory_order_relaxed);
+                order[f % n_bufs] = head;
+                n_filled.store(f + 1, std::memory_order_release);
+                head = (head + 1) % n_bufs;
+        }
+
+        /*
+         * The oldest filled buffer and its length, or NULL if there is
+         * none. It remains in use until passed to release(). Consumer only.
+         */
+        uint8_t* take(size_t& length) {
+                if (n_taken == n_filled.load(std::memory_order_acquire))
+                        return NULL;
+                size_t i = order[n_taken++ % n_bufs];
+                states[i].store(SENDING, std::memory_order_relaxed);
+                length = lengths[i];
+                sent.fetch_add(1, std::memory_order_relaxed);
+                return &storage[i * buf_size];
+        }
+
+        // Return a buffer from take() to the pool. Any thread.
+        void release(const uint8_t* buf) {
+                size_t i = (buf - &storage[0]) / buf_size;
+                in_use.fetch_sub(1, std::memory_order_relaxed);
+                states[i].store(FREE, std::memory_order_release);
+        }
+
+        // release() as a zmq free function; hint is the pool
+        static void zmq_free(void* data, void* hint) {
+                ((buffer_pool*) hint)->release((const uint8_t*) data);
+        }
+
+        // These may be read from any thread
+        size_t size() const { return n_bufs; }
+        uint64_t get_in_use() const { return in_use.load(std::memory_order_relaxed); }
+        uint64_t get_high_water() const { return high_water.load(std::memory_order_relaxed); }
+        uint64_t get_exhausted() const { return exhausted.load(std::memory_order_relaxed); }
+        uint64_t get_dropped() const { return dropped.load(std::memory_order_relaxed); }
+        uint64_t get_sent() const { return sent.load(std::memory_order_relaxed); }
+};
+
+#endif
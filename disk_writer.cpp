@@ -0,0 +1,231 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "disk_writer.h"
+#include "record_format.h"
+
+extern FILE* log_file;
+
+// Alignment required of O_DIRECT writes
+#define DIRECT_ALIGN 4096
+// The write buffer is a multiple of both the alignment and RECORD_LENGTH
+#define WRITE_BUFFER_SIZE (341 * 3 * DIRECT_ALIGN)
+
+disk_writer::disk_writer(spsc_ring& ring, const std::string& path, const disk_writer_config& config)
+        : ring(ring), path(path), config(config), fd(-1), direct(false), file_idx(0),
+          buf(NULL), buf_len(0), tail_written(0), file_bytes(0), total_bytes(0), failed(false), stop(false)
+{
+        if (posix_memalign((void**) &buf, DIRECT_ALIGN, WRITE_BUFFER_SIZE) != 0)
+                throw std::runtime_error("Error allocating write buffer");
+        try {
+                open_file();
+        } catch (...) {
+                free(buf);
+                throw;
+        }
+        thread = std::thread(&disk_writer::run, this);
+}
+
+disk_writer::~disk_writer()
+{
+        stop = true;
+        thread.join();
+        free(buf);
+}
+
+std::string disk_writer::current_path() const
+{
+        std::lock_guard<std::mutex> lock(status_lock);
+        return file_path;
+}
+
+void disk_writer::open_file()
+{
+        std::string p = file_idx == 0 ? path : path + "." + std::to_string(file_idx);
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        fd = open(p.c_str(), flags | O_DIRECT, 0644);
+        direct = fd >= 0;
+        // Not all filesystems support O_DIRECT
+        if (fd < 0 && errno == EINVAL)
+                fd = open(p.c_str(), flags, 0644);
+        if (fd < 0)
+                throw std::runtime_error("Error creating " + p + ": " + strerror(errno));
+
+        file_bytes = 0;
+        tail_written = 0;
+        file_start = last_sync = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(status_lock);
+        file_path = p;
+}
+
+void disk_writer::close_file()
+{
+        write_buffer();
+        if (fsync(fd) != 0)
+                fprintf(log_file, "Error syncing %s: %s\n", current_path().c_str(), strerror(errno));
+        close(fd);
+        fd = -1;
+}
+
+void disk_writer::rotate()
+{
+        close_file();
+        file_idx++;
+        try {
+                open_file();
+        } catch (std::runtime_error& e) {
+                fprintf(log_file, "%s. Recording stopped\n", e.what());
+                failed = true;
+        }
+}
+
+/*
+ * Write out the first len bytes of the buffer, moving the rest to its
+ * start. Bytes already written by write_tail() are counted only once.
+ */
+void disk_writer::write_out(size_t len)
+{
+        size_t done = 0;
+        while (done < len && !failed) {
+                ssize_t res = write(fd, buf + done, len - done);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        fprintf(log_file, "Error writing %s: %s. Recording stopped\n",
+                                current_path().c_str(), strerror(errno));
+                        failed = true;
+                        break;
+                }
+                done += res;
+        }
+        file_bytes += done;
+        total_bytes += done - std::min(done, tail_written);
+        tail_written -= std::min(done, tail_written);
+        buf_len = failed ? 0 : buf_len - done;
+        memmove(buf, buf + done, buf_len);
+}
+
+/*
+ * Write out the buffer. A final partial buffer cannot be written with
+ * O_DIRECT, which is then turned off for the rest of the file.
+ */
+void disk_writer::write_buffer()
+{
+        if (buf_len % DIRECT_ALIGN != 0 && direct) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                direct = false;
+        }
+        write_out(buf_len);
+}
+
+/*
+ * Write the buffer at the end of the file without consuming it. Its
+ * length needn't be aligned, so O_DIRECT is turned off meanwhile, and the
+ * file offset is left where the next write_out() overwrites these bytes.
+ */
+void disk_writer::write_tail()
+{
+        if (failed || tail_written == buf_len)
+                return;
+
+        int flags = fcntl(fd, F_GETFL);
+        if (direct)
+                fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+        size_t done = tail_written;
+        while (done < buf_len) {
+                ssize_t res = pwrite(fd, buf + done, buf_len - done, file_bytes + done);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        fprintf(log_file, "Error writing %s: %s. Recording stopped\n",
+                                current_path().c_str(), strerror(errno));
+                        failed = true;
+                        break;
+                }
+                done += res;
+        }
+        if (direct)
+                fcntl(fd, F_SETFL, flags);
+        total_bytes += done - tail_written;
+        tail_written = done;
+}
+
+void disk_writer::sync()
+{
+        write_out(direct ? buf_len & ~(size_t) (DIRECT_ALIGN - 1) : buf_len);
+        write_tail();
+        if (!failed && fdatasync(fd) != 0)
+                fprintf(log_file, "Error syncing %s: %s\n", current_path().c_str(), strerror(errno));
+        last_sync = std::chrono::steady_clock::now();
+}
+
+void disk_writer::run()
+{
+        const uint64_t rotate_at = (config.rotate_bytes + RECORD_LENGTH - 1) / RECORD_LENGTH * RECORD_LENGTH;
+        while (true) {
+                auto now = std::chrono::steady_clock::now();
+                std::chrono::duration<double> open_for = now - file_start, unsynced = now - last_sync;
+
+                if (!failed && config.rotate_secs && open_for.count() >= config.rotate_secs)
+                        rotate();
+                else if (!failed && config.fsync_secs && unsynced.count() >= config.fsync_secs)
+                        sync();
+
+                size_t length;
+                const uint8_t* data = ring.front(length);
+                if (data == NULL) {
+                        if (stop)
+                                break;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        continue;
+                }
+
+                // After a failure the ring is still drained so it reports no overflows
+                while (length > 0 && !failed) {
+                        // Split the batch where the file reaches its rotation size
+                        size_t n = std::min(length, WRITE_BUFFER_SIZE - buf_len);
+                        if (rotate_at)
+                                n = std::min<uint64_t>(n, rotate_at - (file_bytes + buf_len));
+                        memcpy(buf + buf_len, data, n);
+                        buf_len += n;
+                        data += n;
+                        length -= n;
+                        if (rotate_at && file_bytes + buf_len == rotate_at)
+                                rotate();
+                        else if (buf_len == WRITE_BUFFER_SIZE)
+                                write_buffer();
+                }
+                ring.pop();
+        }
+
+        if (fd >= 0)
+                close_file();
+}
@@ -0,0 +1,104 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+
+#ifndef _DISK_WRITER_H
+#define _DISK_WRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "spsc_ring.h"
+
+struct disk_writer_config {
+        uint64_t rotate_bytes;  // Start a new file after this many bytes, or 0
+        double rotate_secs;     // Start a new file after this many seconds, or 0
+        double fsync_secs;      // Write out and sync data this often, or 0 for only on close
+
+        disk_writer_config() : rotate_bytes(0), rotate_secs(0), fsync_secs(0) { }
+};
+
+/*
+ * Writes the batches of records passed through a ring to disk from a
+ * thread of its own.
+ *
+ * Batches are gathered into a large buffer, aligned to the page size and
+ * a whole number of records long, which is written with O_DIRECT where
+ * the filesystem allows it, bypassing the page cache. Each sync writes out
+ * the buffer first, so that at most fsync_secs of records are lost in a
+ * crash. Its aligned part is consumed; the rest is written without
+ * O_DIRECT and kept, to be written again in place with what follows.
+ *
+ * Batches are whole records. Files are rotated once rotate_bytes rounded
+ * up to a whole record have been written, the first being named PATH
+ * and those following PATH.1, PATH.2 and so on.
+ */
+class disk_writer {
+        spsc_ring& ring;
+        const std::string path;
+        const disk_writer_config config;
+
+        int fd;
+        bool direct;
+        unsigned int file_idx;
+        uint8_t* buf;
+        size_t buf_len;
+        size_t tail_written;    // Bytes at the start of buf already written by sync()
+        uint64_t file_bytes;    // Bytes of the file preceding buf
+        std::chrono::steady_clock::time_point file_start, last_sync;
+
+        mutable std::mutex status_lock;
+        std::string file_path;
+        std::atomic<uint64_t> total_bytes;
+        std::atomic<bool> failed;
+
+        std::atomic<bool> stop;
+        std::thread thread;
+
+        void open_file();
+        void close_file();
+        void rotate();
+        void write_out(size_t len);
+        void write_buffer();
+        void write_tail();
+        void sync();
+        void run();
+
+public:
+        // Throws std::runtime_error if the first file cannot be created
+        disk_writer(spsc_ring& ring, const std::string& path, const disk_writer_config& config);
+        // Writes out whatever remains in the ring before returning
+        ~disk_writer();
+
+        disk_writer(const disk_writer&) = delete;
+        disk_writer& operator=(const disk_writer&) = delete;
+
+        std::string current_path() const;
+        uint64_t bytes_written() const { return total_bytes; }
+        bool has_failed() const { return failed; }
+};
+
+#endif
@@ -21,57 +21,209 @@
  */
 
 
+
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
 #include <unistd.h>
-#include <algorithm>
 #include <time.h>
 
-#include "record_format.h"
+#include "record.h"
 
 using namespace std;
 
 #define CLOCK_RATE (30e6)
-#define DEVIATION 0.7
 
 /*
  *
  * Generates a reasonably realistic photon stream.
  *
  * Usage:
- *   photon_generator [HZ]
+ *   photon_generator [OPTIONS] [HZ]
+ *
+ * Where HZ is the total photon frequency in Hertz, divided evenly between
+ * the four strobe channels.
  *
- * Where HZ is photon frequency in Hertz.
+ * Options:
+ *   -r R0,R1,R2,R3  Poisson rate of each strobe channel in Hertz, in
+ *                   place of HZ
+ *   -s SEED         Seed of the random number generator. The same seed
+ *                   and options always produce the same stream.
+ *   -f              Generate records as fast as possible instead of in
+ *                   real time
+ *   -n N            Stop after N records
+ *   -a PERIOD       Alternate delta channels 0 and 1 every PERIOD
+ *                   seconds, as with alternating-laser excitation
+ *   -l HZ           Rate of lost-sample bursts
+ *   -L N            Records flagged as lost in each burst (default 16)
+ *   -t TIME         Initial counter value, e.g. to reach a timer wrap
+ *                   sooner
+ *   -b SECONDS      Interval between writes when pacing (default 0.01)
  *
  * Output:
- *   A binary photon stream.
+ *   A binary photon stream. Records are written in large buffers; when
+ *   running in real time a batch of records is written each interval.
+ *   A record with no channels set and the wrap flag is emitted each time
+ *   the counter wraps at TIME_BITS, as by the hardware.
  *
  */
 
+struct generator {
+	mt19937_64 rng;
+	vector<double> rates;
+	double total_rate;
+
+	generator(uint64_t seed, const vector<double>& rates) : rng(seed), rates(rates) {
+		total_rate = 0;
+		for (unsigned int i=0; i<rates.size(); i++)
+			total_rate += rates[i];
+	}
+
+	// Uniform on [0,1). Unlike the standard distributions this is the
+	// same for every implementation, keeping streams reproducible.
+	double uniform() {
+		return (rng() >> 11) * (1.0 / (1ULL << 53));
+	}
+
+	// Exponentially distributed interval, in counter units
+	double interval(double rate) {
+		return -log(1 - uniform()) / rate * CLOCK_RATE;
+	}
+
+	// Pick a strobe channel with probability proportional to its rate
+	unsigned int channel() {
+		double u = uniform() * total_rate;
+		unsigned int c = 0;
+		while (c < rates.size() - 1 && u >= rates[c]) {
+			u -= rates[c];
+			c++;
+		}
+		return c;
+	}
+};
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-r R0,R1,R2,R3] [-s seed] [-f] [-n records] [-a period]\n"
+			"       [-l burst_rate] [-L burst_length] [-t time] [-b interval] [hz]\n", name);
+	exit(1);
+}
+
 int main(int argc, char** argv) {
-	if (argc <= 1) {
-		fprintf(stderr, "Usage: %s [hz]\n", argv[0]);
-		return 1;
+	vector<double> rates;
+	uint64_t seed = time(NULL);
+	bool fast = false;
+	uint64_t max_records = 0;
+	double alex_period = 0, burst_rate = 0, batch_interval = 0.01;
+	unsigned int burst_length = 16;
+	double counter = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "r:s:fn:a:l:L:t:b:")) != -1) {
+		switch (c) {
+		case 'r': {
+			char* s = optarg;
+			while (*s) {
+				rates.push_back(strtod(s, &s));
+				if (*s == ',')
+					s++;
+				else if (*s)
+					usage(argv[0]);
+			}
+			if (rates.empty() || rates.size() > 4)
+				usage(argv[0]);
+			break;
+		}
+		case 's': seed = strtoull(optarg, NULL, 0); break;
+		case 'f': fast = true; break;
+		case 'n': max_records = strtoull(optarg, NULL, 0); break;
+		case 'a': alex_period = atof(optarg); break;
+		case 'l': burst_rate = atof(optarg); break;
+		case 'L': burst_length = atoi(optarg); break;
+		case 't': counter = strtod(optarg, NULL); break;
+		case 'b': batch_interval = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (rates.empty()) {
+		if (optind >= argc)
+			usage(argv[0]);
+		rates.assign(4, atof(argv[optind]) / 4);
 	}
 
-	const unsigned int period = 1e9 / atoi(argv[1]); // in nanoseconds
-	count_t counter = 0;
+	generator gen(seed, rates);
+	if (gen.total_rate <= 0)
+		usage(argv[0]);
 
-	setvbuf(stdout, NULL, _IONBF, 0);
-	while (true) {
+	const double delta_interval = alex_period * CLOCK_RATE;
+	const double batch_length = batch_interval * CLOCK_RATE;
+	double next_photon = counter + gen.interval(gen.total_rate);
+	double next_delta = delta_interval > 0 ? counter : INFINITY;
+	double next_burst = burst_rate > 0 ? counter + gen.interval(burst_rate) : INFINITY;
+	double batch_end = counter + batch_length;
+	double start_counter = counter, start_wall = now();
+	unsigned int delta_state = 1, lost_left = 0;
+	uint64_t last_time = counter, n = 0;
+
+	record_writer out(stdout);
+	while (max_records == 0 || n < max_records) {
 		record_t data;
+		if (next_delta <= next_photon) {
+			counter = next_delta;
+			next_delta += delta_interval;
+			data = REC_TYPE_MASK | ((record_t) delta_state << TIME_BITS);
+			delta_state ^= 3;
+		} else {
+			counter = next_photon;
+			next_photon += gen.interval(gen.total_rate);
+			data = CHAN_0_MASK << gen.channel();
+		}
+
+		/*
+		 * Records are written in batches of batch_interval, after
+		 * which we wait for the wall clock to catch up
+		 */
+		if (counter >= batch_end) {
+			out.flush();
+			if (!fast) {
+				double wait = start_wall + (batch_end - start_counter) / CLOCK_RATE - now();
+				if (wait > 0) {
+					timespec ts = { (time_t) wait, (long) (1e9 * (wait - (time_t) wait)) };
+					nanosleep(&ts, NULL);
+				}
+			}
+			batch_end += batch_length;
+		}
+
+		uint64_t time = counter;
+		if ((time >> TIME_BITS) != (last_time >> TIME_BITS)) {
+			// The hardware marks the counter wrapping with an empty record
+			out.write(record(TIMER_WRAP_MASK));
+			n++;
+		}
+		last_time = time;
 
-		// Generate channel mask
-		data = rand();
-		data = (data << TIME_BITS) & CHANNEL_MASK;
-		data |= counter & TIME_MASK;
-		data = htobe64(data) >> 16;
-		fwrite(&data, RECORD_LENGTH, 1, stdout);
-
-		int dt = period + drand48()*DEVIATION*period;
-		timespec ts = { 0, dt };
-		nanosleep(&ts, NULL);
-		counter += 1e-9 * CLOCK_RATE * dt;
+		while (counter >= next_burst) {
+			lost_left = burst_length;
+			next_burst += gen.interval(burst_rate);
+		}
+		if (lost_left > 0) {
+			data |= LOST_SAMPLE_MASK;
+			lost_left--;
+		}
+
+		out.write(record(data | (time & TIME_MASK)));
+		n++;
 	}
+	return 0;
 }
-
@@ -21,11 +21,19 @@
  */
 
 #include "record.h"
+#include "record_unpack.h"
+#include "record_pack.h"
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <cassert>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 
 #ifdef __APPLE__
 #if BYTE_ORDER == LITTLE_ENDIAN
@@ -70,8 +78,14 @@ std::bitset<4> record::get_channels() const {
 
 record_stream::record_stream(FILE* file) : record_stream(file, 0) { }
 
-record_stream::record_stream(FILE* file, unsigned int drop_wraps) : time_offset(0), rec_idx(0), file(file) {
+record_stream::record_stream(FILE* file, unsigned int drop_wraps) :
+        time_offset(0), rec_idx(0), buf(chunk_records*RECORD_LENGTH), buf_head(0), buf_tail(0),
+        last_raw(NULL), format_checked(false)
+{
         assert(file != NULL);
+        fd = fileno(file);
+        // Look at the beginning of the input to recognize its format
+        fill();
         unsigned int i=0;
         while (i < drop_wraps) {
                 record rec = get_record();
@@ -92,53 +106,326 @@ unsigned int get_file_length(const char* path) {
         return buf.st_size / RECORD_LENGTH;
 }
 
+/*
+ * Read more input, returning false at end of stream. Any trailing
+ * partial record is moved to the beginning of the buffer first.
+ */
+bool record_stream::fill() {
+        if (packed)
+                return fill_packed();
+
+        size_t remain = buf_tail - buf_head;
+        if (remain)
+                memmove(&buf[0], &buf[buf_head], remain);
+        buf_head = 0;
+        buf_tail = remain;
+
+        while (buf_tail < RECORD_LENGTH) {
+                ssize_t res = read(fd, &buf[buf_tail], buf.size() - buf_tail);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        throw std::runtime_error("Error reading records");
+                } else if (res == 0) {
+                        if (buf_tail != 0)
+                                throw std::runtime_error("Incomplete record");
+                        return false;
+                }
+                buf_tail += res;
+        }
+
+        if (!format_checked) {
+                format_checked = true;
+                if (memcmp(&buf[0], PACK_MAGIC, 4) == 0) {
+                        packed = std::make_shared<pack_reader>(fd, &buf[0], buf_tail);
+                        buf_head = buf_tail = 0;
+                        return fill_packed();
+                }
+        }
+        return true;
+}
+
+bool record_stream::fill_packed() {
+        size_t n = packed->read_block(buf);
+        buf_head = 0;
+        buf_tail = n*RECORD_LENGTH;
+        return n > 0;
+}
+
+static inline record_t decode_record(const uint8_t* d) {
+        return ((record_t) d[0] << 40) | ((record_t) d[1] << 32)
+             | ((record_t) d[2] << 24) | ((record_t) d[3] << 16)
+             | ((record_t) d[4] << 8)  | ((record_t) d[5] << 0);
+}
+
+/*
+ * Decode n packed records, the first of which is record idx of the
+ * stream, byte-swapping them with the dispatched unpack_raw() kernel
+ * before resolving wraps.
+ */
+static void decode_records(const uint8_t* d, size_t n, uint64_t idx,
+                           uint64_t& time_offset, record* out) {
+        record_t raw[1024];
+        for (size_t i=0; i<n; ) {
+                size_t m = std::min(n - i, sizeof(raw) / sizeof(raw[0]));
+                unpack_raw(d + i*RECORD_LENGTH, m, raw);
+                for (size_t j=0; j<m; j++, i++) {
+                        if (idx + i > 0 && (raw[j] & TIMER_WRAP_MASK))
+                                time_offset += (1ULL<<TIME_BITS) - 1;
+                        out[i].data = raw[j];
+                        out[i].time_offset = time_offset;
+                }
+        }
+}
+
+size_t record_stream::read_records(record* out, size_t n) {
+        size_t done = 0;
+        last_raw = &buf[buf_head];
+        while (done < n) {
+                size_t avail = (buf_tail - buf_head) / RECORD_LENGTH;
+                if (avail == 0) {
+                        // Don't block for more input if we have something to return
+                        if (done > 0 || !fill())
+                                break;
+                        last_raw = &buf[buf_head];
+                        continue;
+                }
+
+                size_t m = std::min(avail, n - done);
+                decode_records(&buf[buf_head], m, rec_idx, time_offset, out + done);
+                rec_idx += m;
+                buf_head += m*RECORD_LENGTH;
+                done += m;
+        }
+        return done;
+}
+
+void record_stream::seek(uint64_t idx, uint64_t offset) {
+        buf_head = buf_tail = 0;
+        if (packed) {
+                uint64_t skip = packed->seek(idx);
+                if (fill_packed())
+                        buf_head = std::min<size_t>(skip*RECORD_LENGTH, buf_tail);
+        } else if (lseek(fd, idx*RECORD_LENGTH, SEEK_SET) < 0) {
+                throw std::runtime_error("Error seeking in record stream");
+        }
+        rec_idx = idx;
+        time_offset = offset;
+}
+
+size_t record_stream::read_columns(uint64_t* times, uint8_t* channels, uint8_t* flags, size_t n) {
+        size_t done = 0;
+        unpack_state state(time_offset, rec_idx);
+        last_raw = &buf[buf_head];
+        while (done < n) {
+                size_t avail = (buf_tail - buf_head) / RECORD_LENGTH;
+                if (avail == 0) {
+                        if (done > 0 || !fill())
+                                break;
+                        last_raw = &buf[buf_head];
+                        continue;
+                }
+
+                size_t m = std::min(avail, n - done);
+                unpack_records(&buf[buf_head], m, times+done, channels+done, flags+done, state);
+                buf_head += m*RECORD_LENGTH;
+                done += m;
+        }
+        time_offset = state.time_offset;
+        rec_idx = state.rec_idx;
+        return done;
+}
+
 record record_stream::get_record() {
-        record_t data;
-        int res = fread(&data, 1, RECORD_LENGTH, file);
-        if (res == 0)
+        record rec;
+        if (read_records(&rec, 1) == 0)
                 throw end_stream();
-        else if (res < RECORD_LENGTH)
-                throw std::runtime_error("Incomplete record");
-        rec_idx++;
-
-#if defined(LITTLE_ENDIAN)
-        uint8_t* d = (uint8_t*) &data;
-        std::swap(d[0], d[5]);
-        std::swap(d[1], d[4]);
-        std::swap(d[2], d[3]);
-#elif defined(BIG_ENDIAN)
-#else
-#error Either LITTLE_ENDIAN or BIG_ENDIAN must be defined.
-#endif
-
-        record rec(data);
-        if (rec_idx > 1 && rec.get_wrap_flag())
-                time_offset += (1ULL<<TIME_BITS) - 1;
-        rec.time_offset = time_offset;
         return rec;
 }
 
 std::vector<parsed_record> record_stream::parse_records(unsigned int n) {
         std::vector<parsed_record> buf;
+        std::vector<record> recs(std::min<size_t>(n, chunk_records));
+        buf.reserve(n);
+
+        while (buf.size() < n) {
+                size_t m = read_records(&recs[0], std::min(recs.size(), n - buf.size()));
+                if (m == 0)
+                        throw end_stream();
 
-        for (unsigned int i=0; i<n; i++) {
-                record r = get_record();
-                parsed_record pr;
+                for (size_t i=0; i<m; i++) {
+                        const record& r = recs[i];
+                        parsed_record pr;
 
-                pr.time = r.get_time();
-                pr.type = r.get_type();
-                pr.wrap = r.get_wrap_flag();
-                pr.lost = r.get_lost_flag();
+                        pr.time = r.get_time();
+                        pr.type = r.get_type();
+                        pr.wrap = r.get_wrap_flag();
+                        pr.lost = r.get_lost_flag();
 
-                std::bitset<4> ch = r.get_channels();
-                for (unsigned int j=0; j<4; j++)
-                        pr.channels[j] = ch[j];
+                        std::bitset<4> ch = r.get_channels();
+                        for (unsigned int j=0; j<4; j++)
+                                pr.channels[j] = ch[j];
 
-                buf.push_back(pr);
+                        buf.push_back(pr);
+                }
         }
         return buf;
 }
 
+record_file::record_file(const char* path) : owns_fd(true), base(NULL), n_records(0) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                throw std::runtime_error("Error opening record file");
+        map();
+}
+
+record_file::record_file(int fd) : fd(fd), owns_fd(false), base(NULL), n_records(0) {
+        map();
+}
+
+void record_file::map() {
+        struct stat buf;
+        if (fstat(fd, &buf))
+                throw std::runtime_error("Error in fstat()");
+
+        n_records = buf.st_size / RECORD_LENGTH;
+        if (n_records == 0)
+                return;
+
+        void* p = mmap(NULL, n_records*RECORD_LENGTH, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+                throw std::runtime_error("Error mapping record file");
+        base = (const uint8_t*) p;
+}
+
+record_file::~record_file() {
+        if (base)
+                munmap((void*) base, n_records*RECORD_LENGTH);
+        if (owns_fd)
+                close(fd);
+}
+
+record_t record_file::get_raw(size_t i) const {
+        assert(i < n_records);
+        return decode_record(raw(i));
+}
+
+record record_file::get_record(size_t i, uint64_t time_offset) const {
+        return record(get_raw(i), time_offset);
+}
+
+uint64_t record_file::count_wraps(size_t start, size_t end) const {
+        // The wrap flag of the first record in the file is ignored
+        if (start == 0)
+                start = 1;
+
+        // Flags live in the most significant byte
+        const uint8_t flag = TIMER_WRAP_MASK >> 40;
+        uint64_t n = 0;
+        for (const uint8_t* p = raw(start); p < raw(end); p += RECORD_LENGTH)
+                n += (*p & flag) != 0;
+        return n;
+}
+
+size_t record_file::find_last_delta(size_t start, size_t end) const {
+        const uint8_t flag = REC_TYPE_MASK >> 40;
+        for (size_t i = end; i > start; i--) {
+                if (*raw(i-1) & flag)
+                        return i-1;
+        }
+        return end;
+}
+
+void record_file::advise(size_t start, size_t end, int advice) const {
+        if (start >= end)
+                return;
+
+        // madvise() requires a page-aligned address
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t a = (uintptr_t) raw(start) & ~(page - 1);
+        uintptr_t b = (uintptr_t) raw(end);
+        madvise((void*) a, b - a, advice);
+}
+
+record_range record_file::range(size_t start, size_t end, uint64_t time_offset) const {
+        return record_range(*this, start, end, time_offset);
+}
+
+record_range::record_range(const record_file& file, size_t start, size_t end, uint64_t time_offset)
+        : file(file), pos(start), end(std::min(end, file.size())), time_offset(time_offset)
+{
+        file.advise(pos, this->end, MADV_SEQUENTIAL);
+}
+
+size_t record_range::read_records(record* out, size_t n) {
+        n = std::min(n, end - pos);
+
+        // Ask for the next batch to be read in while we decode this one
+        file.advise(pos + n, std::min(pos + 2*n, end), MADV_WILLNEED);
+
+        decode_records(file.raw(pos), n, pos, time_offset, out);
+        pos += n;
+        return n;
+}
+
+record_writer::record_writer(int fd, size_t buffer_size) :
+        fd(fd), buf_size(buffer_size), buf_len(0)
+{
+        // Leave room for the bytes clobbered by encode()
+        if (posix_memalign((void**) &buf, 4096, buf_size + 2))
+                throw std::runtime_error("Error allocating record buffer");
+}
+
+record_writer::record_writer(FILE* file, size_t buffer_size) :
+        record_writer(fileno(file), buffer_size) { }
+
+record_writer::~record_writer() {
+        try {
+                flush();
+        } catch (std::runtime_error& e) {
+                fprintf(stderr, "Error flushing records: %s\n", e.what());
+        }
+        free(buf);
+}
+
+void record_writer::encode(record_t data, uint8_t* dest) {
+        uint64_t be = htobe64(data << 16);
+        memcpy(dest, &be, 8);
+}
+
+void record_writer::write_records(const record* r, size_t n) {
+        for (size_t i=0; i<n; i++)
+                write(r[i]);
+}
+
+void record_writer::write_raw(const uint8_t* data, size_t n) {
+        size_t bytes = n*RECORD_LENGTH;
+        while (bytes > 0) {
+                if (buf_len == buf_size)
+                        flush();
+                size_t m = std::min(bytes, buf_size - buf_len);
+                memcpy(buf + buf_len, data, m);
+                buf_len += m;
+                data += m;
+                bytes -= m;
+        }
+}
+
+void record_writer::flush() {
+        size_t off = 0;
+        while (off < buf_len) {
+                ssize_t res = ::write(fd, buf + off, buf_len - off);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        buf_len = 0;
+                        throw std::runtime_error("Error writing records");
+                }
+                off += res;
+        }
+        buf_len = 0;
+}
+
 void write_record(FILE* fout, record r) {
         record_t data;
         data = r.data;
@@ -21,11 +21,16 @@
  */
 
 
+#ifndef _RECORD_H
+#define _RECORD_H
+
 #include <cstdint>
+#include <cstdio>
 #include <stdexcept>
 #include <bitset>
 #include <vector>
 #include <array>
+#include <memory>
 #include "record_format.h"
 
 struct end_stream : std::exception { };
@@ -35,7 +40,7 @@ struct record {
         uint64_t time_offset;
         enum type { STROBE, DELTA };
 
-        record(record_t data, int64_t time_offset=0) : data(data), time_offset(time_offset) { }
+        record(record_t data=0, int64_t time_offset=0) : data(data), time_offset(time_offset) { }
         type get_type() const;
         uint64_t get_time() const;
         uint64_t get_raw_time() const;
@@ -52,18 +57,175 @@ struct parsed_record {
         std::array<bool,4> channels;
 };
 
+class pack_reader;
+
+/*
+ * Decodes a stream of packed records read from a file descriptor.
+ *
+ * Input is read in large chunks with read(2) and decoded in batches by
+ * read_records(), which resolves timer wraps as it goes. get_record() is
+ * kept for callers which only need the occasional record.
+ *
+ * Input in the compressed container format (see record_pack.h) is
+ * recognized and decoded transparently.
+ */
 class record_stream {
         uint64_t time_offset;
         uint64_t rec_idx;
-        FILE* file;
+        int fd;
+        std::vector<uint8_t> buf;
+        size_t buf_head, buf_tail;      // Bounds of undecoded data in buf
+        const uint8_t* last_raw;
+        bool format_checked;
+        std::shared_ptr<pack_reader> packed;
+
+        bool fill();
+        bool fill_packed();
 
 public:
+        // Number of records read from the input at once
+        static const size_t chunk_records = 1 << 16;
+
         record_stream(FILE* file);
         record_stream(FILE* file, unsigned int drop_wraps);
+
+        /*
+         * Decode up to n records into out. Returns the number of records
+         * decoded, which is zero only at the end of the stream. Fewer than
+         * n records are returned when no more input is immediately
+         * available.
+         */
+        size_t read_records(record* out, size_t n);
+
+        /*
+         * Like read_records() but decodes into separate timestamp, channel
+         * mask and flag arrays (see record_unpack.h).
+         */
+        size_t read_columns(uint64_t* times, uint8_t* channels, uint8_t* flags, size_t n);
+
+        /*
+         * The packed form of the records returned by the last call to
+         * read_records() or read_columns(), valid until the next call.
+         */
+        const uint8_t* raw_records() const { return last_raw; }
+
         record get_record();
         std::vector<parsed_record> parse_records(unsigned int n);
+
+        // Whether the input is in the compressed container format
+        bool is_packed() const { return packed != NULL; }
+
+        // Whether read_records() can return records without reading input
+        bool has_buffered() const { return buf_tail - buf_head >= RECORD_LENGTH; }
+
+        // Index of the next record to be returned
+        uint64_t tell() const { return rec_idx; }
+        uint64_t get_time_offset() const { return time_offset; }
+
+        /*
+         * Reposition a seekable stream such that the next record returned
+         * is rec_idx. time_offset is the wrap offset in effect at the
+         * preceding record.
+         */
+        void seek(uint64_t rec_idx, uint64_t time_offset);
+};
+
+class record_file;
+
+/*
+ * A sequential view of a range of a record_file, decoded with the same
+ * interface as record_stream.
+ */
+class record_range {
+        const record_file& file;
+        size_t pos, end;
+        uint64_t time_offset;
+
+public:
+        record_range(const record_file& file, size_t start, size_t end, uint64_t time_offset=0);
+        size_t read_records(record* out, size_t n);
+        size_t tell() const { return pos; }
+        uint64_t get_time_offset() const { return time_offset; }
+};
+
+/*
+ * A capture file mapped into memory, giving random access to its records.
+ */
+class record_file {
+        int fd;
+        bool owns_fd;
+        const uint8_t* base;
+        size_t n_records;
+
+        void map();
+
+public:
+        record_file(const char* path);
+        // Map an already open file. The descriptor is not closed.
+        record_file(int fd);
+        record_file(const record_file&) = delete;
+        record_file& operator=(const record_file&) = delete;
+        ~record_file();
+
+        size_t size() const { return n_records; }
+        const uint8_t* raw(size_t i) const { return base + i*RECORD_LENGTH; }
+        record_t get_raw(size_t i) const;
+        record get_record(size_t i, uint64_t time_offset=0) const;
+
+        // Number of records in [start, end) which advance the wrap offset
+        uint64_t count_wraps(size_t start, size_t end) const;
+        // Index of the last delta record in [start, end), or end if none
+        size_t find_last_delta(size_t start, size_t end) const;
+
+        void advise(size_t start, size_t end, int advice) const;
+
+        /*
+         * Iterate over records [start, end). time_offset is the wrap offset
+         * in effect at record start-1.
+         */
+        record_range range(size_t start, size_t end, uint64_t time_offset=0) const;
+};
+
+/*
+ * Buffered writer of packed records.
+ *
+ * Records are encoded into a page-aligned buffer which is written out
+ * with a single write(2) when full. write_raw() copies records which are
+ * already in packed form, avoiding a decode/encode round trip for
+ * records which are passed through unchanged.
+ */
+class record_writer {
+        int fd;
+        uint8_t* buf;
+        size_t buf_size, buf_len;
+
+public:
+        static const size_t default_buffer_size = 1 << 20;
+
+        record_writer(int fd, size_t buffer_size=default_buffer_size);
+        record_writer(FILE* file, size_t buffer_size=default_buffer_size);
+        record_writer(const record_writer&) = delete;
+        record_writer& operator=(const record_writer&) = delete;
+        ~record_writer();
+
+        void write(const record& r) {
+                if (buf_len + RECORD_LENGTH > buf_size)
+                        flush();
+                encode(r.data, buf + buf_len);
+                buf_len += RECORD_LENGTH;
+        }
+
+        void write_records(const record* r, size_t n);
+        // Copy n records in packed form
+        void write_raw(const uint8_t* data, size_t n);
+        void flush();
+
+        // Pack a record into dest. Two bytes past the record are clobbered.
+        static void encode(record_t data, uint8_t* dest);
 };
 
 unsigned int get_file_length(const char* path);
 void write_record(FILE* fd, record r);
 
+#endif
+
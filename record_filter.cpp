@@ -0,0 +1,294 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include "record_filter.h"
+#include "record_unpack.h"
+
+uint64_t parse_time(const std::string& s) {
+        const char* p = s.c_str();
+        char* end;
+        errno = 0;
+        uint64_t t = strtoull(p, &end, 10);
+        if (end != p && *end == '\0' && errno == 0 && isdigit(*p))
+                return t;
+
+        // Not an exact integer; accept any non-negative number
+        double d = strtod(p, &end);
+        if (end == p || *end != '\0' || !(d >= 0) || d >= 18446744073709551616.0)
+                throw std::runtime_error("Invalid time '" + s + "'");
+        return llround(d);
+}
+
+/*
+ * Recursive descent parser emitting the postfix program,
+ *
+ *   expr    := and ('||' and)*
+ *   and     := unary ('&&' unary)*
+ *   unary   := '!' unary | primary
+ *   primary := '(' expr ')' | 'strobe' chans | 'delta' chans
+ *            | 'time' 'in' interval | 'lost' | 'wrap' | 'true' | 'false'
+ */
+struct filter_parser {
+        const std::string& s;
+        size_t pos;
+        std::vector<record_filter::op>& prog;
+        size_t depth, max_depth;
+
+        filter_parser(const std::string& s, std::vector<record_filter::op>& prog)
+                : s(s), pos(0), prog(prog), depth(0), max_depth(0) { }
+
+        void fail(const std::string& what) {
+                throw std::runtime_error("Error in filter at column " + std::to_string(pos+1)
+                                         + ": expected " + what);
+        }
+
+        void skip_space() {
+                while (pos < s.size() && isspace(s[pos]))
+                        pos++;
+        }
+
+        bool accept(const char* tok) {
+                skip_space();
+                size_t n = strlen(tok);
+                if (s.compare(pos, n, tok) != 0)
+                        return false;
+                // Keywords must not run into a following identifier
+                if (isalpha(tok[0]) && pos+n < s.size() && isalnum(s[pos+n]))
+                        return false;
+                pos += n;
+                return true;
+        }
+
+        void expect(const char* tok) {
+                if (!accept(tok))
+                        fail(std::string("'") + tok + "'");
+        }
+
+        void emit(record_filter::op::kind k, uint8_t mask=0, uint64_t start=0, uint64_t span=0) {
+                record_filter::op o = { k, mask, start, span };
+                prog.push_back(o);
+                switch (k) {
+                case record_filter::op::NOT:
+                        break;
+                case record_filter::op::AND:
+                case record_filter::op::OR:
+                        depth--;
+                        break;
+                default:
+                        depth++;
+                        max_depth = std::max(max_depth, depth);
+                }
+        }
+
+        uint8_t channels() {
+                uint8_t mask = 0;
+                expect("(");
+                do {
+                        skip_space();
+                        if (pos >= s.size() || s[pos] < '0' || s[pos] > '3')
+                                fail("channel number 0-3");
+                        mask |= 1 << (s[pos++] - '0');
+                } while (accept("|"));
+                expect(")");
+                return mask;
+        }
+
+        uint64_t time() {
+                skip_space();
+                size_t start = pos;
+                while (pos < s.size() && (isalnum(s[pos]) || s[pos] == '.'
+                                          || ((s[pos] == '+' || s[pos] == '-')
+                                              && pos > start && tolower(s[pos-1]) == 'e')))
+                        pos++;
+                if (pos == start)
+                        fail("time");
+                return parse_time(s.substr(start, pos-start));
+        }
+
+        void interval() {
+                bool open_start;
+                if (accept("["))
+                        open_start = false;
+                else if (accept("("))
+                        open_start = true;
+                else
+                        fail("'[' or '('");
+                uint64_t t0 = time();
+                expect(",");
+                uint64_t t1 = time();
+                bool closed_end;
+                if (accept("]"))
+                        closed_end = true;
+                else if (accept(")"))
+                        closed_end = false;
+                else
+                        fail("']' or ')'");
+
+                // Normalize to [start, start+span), minding overflow at either end
+                uint64_t start = t0 + open_start, end = t1 + closed_end, span;
+                if (open_start && t0 == UINT64_MAX)
+                        span = 0;
+                else if (closed_end && t1 == UINT64_MAX)
+                        span = start == 0 ? UINT64_MAX : UINT64_MAX - start + 1;
+                else
+                        span = end > start ? end - start : 0;
+                emit(record_filter::op::TIME, 0, start, span);
+        }
+
+        void primary() {
+                if (accept("(")) {
+                        expr();
+                        expect(")");
+                } else if (accept("strobe")) {
+                        emit(record_filter::op::STROBE, channels());
+                } else if (accept("delta")) {
+                        emit(record_filter::op::DELTA, channels());
+                } else if (accept("time")) {
+                        expect("in");
+                        interval();
+                } else if (accept("lost")) {
+                        emit(record_filter::op::FLAG, UNPACK_FLAG_LOST);
+                } else if (accept("wrap")) {
+                        emit(record_filter::op::FLAG, UNPACK_FLAG_WRAP);
+                } else if (accept("true")) {
+                        emit(record_filter::op::CONST, 1);
+                } else if (accept("false")) {
+                        emit(record_filter::op::CONST, 0);
+                } else {
+                        fail("term");
+                }
+        }
+
+        void unary() {
+                if (accept("!")) {
+                        unary();
+                        emit(record_filter::op::NOT);
+                } else {
+                        primary();
+                }
+        }
+
+        void conjunction() {
+                unary();
+                while (accept("&&")) {
+                        unary();
+                        emit(record_filter::op::AND);
+                }
+        }
+
+        void expr() {
+                conjunction();
+                while (accept("||")) {
+                        conjunction();
+                        emit(record_filter::op::OR);
+                }
+        }
+
+        void parse() {
+                expr();
+                skip_space();
+                if (pos != s.size())
+                        fail("end of expression");
+        }
+};
+
+record_filter::record_filter(const std::string& expr) {
+        filter_parser p(expr, prog);
+        p.parse();
+        depth = p.max_depth;
+        stack.resize(depth);
+}
+
+bool record_filter::uses_deltas() const {
+        for (const op& o : prog)
+                if (o.k == op::DELTA)
+                        return true;
+        return false;
+}
+
+void record_filter::eval(const filter_block& b, uint8_t* out) {
+        const size_t n = b.n;
+        for (auto& s : stack)
+                if (s.size() < n)
+                        s.resize(n);
+
+        size_t sp = 0;
+        for (const op& o : prog) {
+                uint8_t* d = o.k >= op::NOT ? &stack[sp-1][0] : &stack[sp++][0];
+                const uint8_t m = o.mask;
+                switch (o.k) {
+                case op::STROBE:
+                        for (size_t i=0; i<n; i++)
+                                d[i] = ((b.channels[i] & m) != 0) & !(b.flags[i] & UNPACK_FLAG_DELTA);
+                        break;
+                case op::DELTA:
+                        for (size_t i=0; i<n; i++)
+                                d[i] = (b.deltas[i] & m) != 0;
+                        break;
+                case op::TIME:
+                        for (size_t i=0; i<n; i++)
+                                d[i] = b.times[i] - o.start < o.span;
+                        break;
+                case op::FLAG:
+                        for (size_t i=0; i<n; i++)
+                                d[i] = (b.flags[i] & m) != 0;
+                        break;
+                case op::CONST:
+                        memset(d, m, n);
+                        break;
+                case op::NOT:
+                        for (size_t i=0; i<n; i++)
+                                d[i] ^= 1;
+                        break;
+                case op::AND:
+                case op::OR: {
+                        uint8_t* a = &stack[sp-2][0];
+                        if (o.k == op::AND)
+                                for (size_t i=0; i<n; i++)
+                                        a[i] &= d[i];
+                        else
+                                for (size_t i=0; i<n; i++)
+                                        a[i] |= d[i];
+                        sp--;
+                        break;
+                }
+                }
+        }
+        memcpy(out, &stack[0][0], n);
+}
+
+void track_deltas(const uint8_t* channels, const uint8_t* flags, size_t n,
+                  uint8_t* deltas, uint8_t& state) {
+        uint8_t s = state;
+        for (size_t i=0; i<n; i++) {
+                s = (flags[i] & UNPACK_FLAG_DELTA) ? channels[i] : s;
+                deltas[i] = s;
+        }
+        state = s;
+}
@@ -0,0 +1,100 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+
+#ifndef _RECORD_FILTER_H
+#define _RECORD_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Predicates over records given as expressions such as
+ *
+ *   strobe(0|2) && delta(1) && time in [t0,t1) && !lost
+ *
+ * The terms are,
+ *
+ *   strobe(A|B...)     a strobe record with any of the given channels
+ *   delta(A|B...)      any of the given delta channels active
+ *   time in [T0,T1)    wrap-resolved time within the interval, each end
+ *                      of which may be closed [ ] or open ( )
+ *   lost, wrap         the lost sample or timer wrap flag is set
+ *   true, false
+ *
+ * combined with !, && and || (binding in that order) and parentheses.
+ * Times are exact 64-bit integers but may be given as 1e9 and the like.
+ *
+ * An expression is compiled once into a postfix program. Each
+ * instruction is applied to a whole block of records in their column
+ * form (see record_stream::read_columns) giving a byte for each record,
+ * so that evaluation involves no per-record branches.
+ */
+
+// A block of decoded records
+struct filter_block {
+        size_t n;
+        const uint64_t* times;
+        const uint8_t* channels;
+        const uint8_t* flags;
+        const uint8_t* deltas;  // Delta channel state in effect at each record
+};
+
+class record_filter {
+public:
+        struct op {
+                enum kind { STROBE, DELTA, TIME, FLAG, CONST, NOT, AND, OR };
+                kind k;
+                uint8_t mask;
+                uint64_t start, span;   // Times accepted are [start, start+span)
+        };
+
+private:
+        std::vector<op> prog;
+        size_t depth;
+        std::vector<std::vector<uint8_t>> stack;
+
+public:
+        // Throws std::runtime_error if the expression is malformed
+        record_filter(const std::string& expr);
+
+        // Whether the predicate depends upon the delta channel state
+        bool uses_deltas() const;
+
+        // Set out[i] to 1 if record i of the block matches, otherwise 0
+        void eval(const filter_block& b, uint8_t* out);
+};
+
+/*
+ * Fill deltas with the delta channel state in effect at each of n
+ * records. state is that at the preceding record and is updated.
+ */
+void track_deltas(const uint8_t* channels, const uint8_t* flags, size_t n,
+                  uint8_t* deltas, uint8_t& state);
+
+// Parse a time given as an integer or in exponent notation
+uint64_t parse_time(const std::string& s);
+
+#endif
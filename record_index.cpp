@@ -0,0 +1,178 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include "record_index.h"
+
+record_index::record_index(const char* path) {
+        FILE* f = fopen(path, "r");
+        if (f == NULL)
+                throw std::runtime_error("Error opening index");
+
+        index_header hdr;
+        if (fread(&hdr, sizeof(hdr), 1, f) != 1
+            || memcmp(hdr.magic, INDEX_MAGIC, 4) != 0) {
+                fclose(f);
+                throw std::runtime_error("Invalid index");
+        }
+        if (hdr.version != INDEX_VERSION || hdr.entry_size != sizeof(index_entry)) {
+                fclose(f);
+                throw std::runtime_error("Unsupported index version");
+        }
+        stride = hdr.stride;
+        n_records = hdr.n_records;
+
+        // A partial entry at the end of an open index is ignored
+        index_entry e;
+        while (fread(&e, sizeof(e), 1, f) == 1)
+                entries.push_back(e);
+        fclose(f);
+
+        if (n_records == INDEX_OPEN)
+                n_records = entries.empty() ? 0 : entries.back().rec_idx + 1;
+
+        // An empty file still has a beginning
+        if (entries.empty()) {
+                memset(&e, 0, sizeof(e));
+                e.delta_idx = ~0ULL;
+                entries.push_back(e);
+        }
+}
+
+const index_entry& record_index::find_record(uint64_t idx) const {
+        auto it = std::upper_bound(entries.begin(), entries.end(), idx,
+                [](uint64_t idx, const index_entry& e) { return idx < e.rec_idx; });
+        return it == entries.begin() ? *it : *(it-1);
+}
+
+const index_entry& record_index::find_time(uint64_t t) const {
+        auto it = std::lower_bound(entries.begin(), entries.end(), t,
+                [](const index_entry& e, uint64_t t) { return e.time < t; });
+        return it == entries.begin() ? *it : *(it-1);
+}
+
+const index_entry& record_index::find_wrap(uint64_t n) const {
+        auto it = std::lower_bound(entries.begin(), entries.end(), n,
+                [](const index_entry& e, uint64_t n) { return e.wraps < n; });
+        return it == entries.begin() ? *it : *(it-1);
+}
+
+record_index_builder::record_index_builder(const char* path, uint32_t stride) :
+        stride(stride), rec_idx(0), last_offset(0)
+{
+        out = fopen(path, "w");
+        if (out == NULL)
+                throw std::runtime_error("Error opening index for writing");
+
+        memset(&state, 0, sizeof(state));
+        state.delta_idx = ~0ULL;
+
+        index_header hdr;
+        memcpy(hdr.magic, INDEX_MAGIC, 4);
+        hdr.version = INDEX_VERSION;
+        hdr.stride = stride;
+        hdr.entry_size = sizeof(index_entry);
+        hdr.n_records = INDEX_OPEN;
+        if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 || fflush(out) != 0)
+                throw std::runtime_error("Error writing index");
+}
+
+record_index_builder::~record_index_builder() {
+        if (out) {
+                try {
+                        finish();
+                } catch (std::runtime_error& e) {
+                        fprintf(stderr, "Error finishing index: %s\n", e.what());
+                }
+        }
+}
+
+void record_index_builder::add(const record* recs, size_t n) {
+        for (size_t i=0; i<n; i++, rec_idx++) {
+                const record& r = recs[i];
+                if (rec_idx % stride == 0) {
+                        state.rec_idx = rec_idx;
+                        state.offset = rec_idx * RECORD_LENGTH;
+                        state.time = r.get_time();
+                        state.time_offset = last_offset;
+                        // Flushed so that readers of an open index see every entry
+                        if (fwrite(&state, sizeof(state), 1, out) != 1 || fflush(out) != 0)
+                                throw std::runtime_error("Error writing index");
+                }
+
+                last_offset = r.time_offset;
+                if (r.get_wrap_flag())
+                        state.wraps++;
+
+                std::bitset<4> chans = r.get_channels();
+                if (r.get_type() == record::DELTA) {
+                        state.delta_idx = rec_idx;
+                        state.delta_state = chans.to_ulong();
+                } else {
+                        for (int c=0; c<4; c++)
+                                state.counts[c] += chans[c];
+                }
+        }
+}
+
+void record_index_builder::finish() {
+        uint64_t n_records = rec_idx;
+        FILE* f = out;
+        out = NULL;
+        bool ok = fseek(f, offsetof(index_header, n_records), SEEK_SET) == 0
+                  && fwrite(&n_records, sizeof(n_records), 1, f) == 1;
+        // The write only reaches the file as it is closed
+        ok = fclose(f) == 0 && ok;
+        if (!ok)
+                throw std::runtime_error("Error writing index");
+}
+
+uint64_t seek_wraps(record_stream& stream, const record_index& index, unsigned int n) {
+        if (n == 0)
+                return 0;
+
+        const index_entry& e = index.find_wrap(n);
+        stream.seek(e.rec_idx, e.time_offset);
+
+        uint64_t wraps = e.wraps;
+        record r;
+        while (wraps < n) {
+                r = stream.get_record();
+                if (r.get_wrap_flag())
+                        wraps++;
+        }
+
+        stream.seek(stream.tell(), 0);
+        return r.time_offset;
+}
+
+const index_entry* seek_time(record_stream& stream, const record_index& index,
+                             uint64_t t, uint64_t dropped) {
+        const index_entry& e = index.find_time(t + dropped);
+        if (e.rec_idx <= stream.tell())
+                return NULL;
+
+        stream.seek(e.rec_idx, e.time_offset - dropped);
+        return &e;
+}
@@ -0,0 +1,140 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#ifndef _RECORD_INDEX_H
+#define _RECORD_INDEX_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "record.h"
+
+/*
+ * Sidecar index of a record file, by convention named FILE.idx.
+ *
+ * Every stride records the index notes the position of the record along
+ * with the state one would otherwise need to read the preceding records
+ * to know: the wrap offset, the number of wraps, per-channel strobe
+ * counts and the delta channel state. This allows tools to seek to a
+ * time or wrap in O(log n).
+ *
+ * The file consists of an index_header followed by index_entries. The
+ * header is complete from the start, so an index which is still being
+ * written, or whose writer died, can be read: its n_records is
+ * INDEX_OPEN and the entries are counted from the size of the file.
+ */
+
+#define INDEX_MAGIC "TTIX"
+#define INDEX_VERSION 1
+#define INDEX_OPEN (~0ULL)
+
+struct index_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t stride;        // Records between entries
+        uint32_t entry_size;
+        uint64_t n_records;     // Records covered by the index or INDEX_OPEN
+};
+
+struct index_entry {
+        uint64_t rec_idx;       // Index of the record
+        uint64_t offset;        // Byte offset of the record
+        uint64_t time;          // Time of the record
+        uint64_t time_offset;   // Wrap offset in effect at the preceding record
+        uint64_t wraps;         // Wrap flags set in preceding records
+        uint64_t delta_idx;     // Index of the last preceding delta record or ~0
+        uint64_t counts[4];     // Preceding strobe events on each channel
+        uint8_t delta_state;    // Channels of the last preceding delta record
+        uint8_t pad[7];
+};
+
+class record_index {
+        std::vector<index_entry> entries;
+        uint32_t stride;
+        uint64_t n_records;
+
+public:
+        record_index(const char* path);
+
+        static std::string path_for(const std::string& data_path) { return data_path + ".idx"; }
+
+        uint32_t get_stride() const { return stride; }
+        // Records covered, which for an open index ends at its last entry
+        uint64_t size() const { return n_records; }
+        const std::vector<index_entry>& get_entries() const { return entries; }
+
+        // The last entry at or before record idx
+        const index_entry& find_record(uint64_t idx) const;
+        // The last entry preceding all records with time >= t
+        const index_entry& find_time(uint64_t t) const;
+        // The last entry preceding the nth wrap flag
+        const index_entry& find_wrap(uint64_t n) const;
+};
+
+/*
+ * Builds an index from records fed to it in order, writing entries out
+ * as they are produced so that an index can be written while capturing.
+ */
+class record_index_builder {
+        FILE* out;
+        uint32_t stride;
+        uint64_t rec_idx;
+        uint64_t last_offset;
+        index_entry state;
+
+public:
+        static const uint32_t default_stride = 1 << 16;
+
+        record_index_builder(const char* path, uint32_t stride=default_stride);
+        record_index_builder(const record_index_builder&) = delete;
+        record_index_builder& operator=(const record_index_builder&) = delete;
+        ~record_index_builder();
+
+        void add(const record* recs, size_t n);
+        // Record the number of records in the header and close the index,
+        // throwing if either fails
+        void finish();
+};
+
+/*
+ * Seeking a stream with an index. The stream must be over a regular file
+ * starting at record 0.
+ */
+
+/*
+ * Position the stream just past the nth wrap flag and reset its time
+ * offset, as record_stream(file, n) does. Returns the absolute wrap offset
+ * which was dropped.
+ */
+uint64_t seek_wraps(record_stream& stream, const record_index& index, unsigned int n);
+
+/*
+ * Move the stream forward to the index entry preceding the first record
+ * at or after time t. dropped is the offset returned by seek_wraps(), if
+ * any. Returns the entry used or NULL if the stream was not moved.
+ */
+const index_entry* seek_time(record_stream& stream, const record_index& index,
+                             uint64_t t, uint64_t dropped=0);
+
+#endif
@@ -0,0 +1,337 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include "record_pack.h"
+#include "record_unpack.h"
+
+// Bits of a record which are not part of the format
+#define RESERVED_MASK (((1ULL << 48) - 1) & ~(TIME_MASK | CHANNEL_MASK | REC_TYPE_MASK \
+                                               | TIMER_WRAP_MASK | LOST_SAMPLE_MASK))
+
+static inline uint8_t record_symbol(record_t r) {
+        return ((r & CHANNEL_MASK) >> TIME_BITS) | ((r >> 45) << 4);
+}
+
+static inline record_t symbol_bits(uint8_t sym) {
+        return ((record_t) (sym & 0xf) << TIME_BITS) | ((record_t) ((sym >> 4) & 0x7) << 45);
+}
+
+static inline void put_varint(std::vector<uint8_t>& out, uint64_t v) {
+        while (v >= 0x80) {
+                out.push_back(v | 0x80);
+                v >>= 7;
+        }
+        out.push_back(v);
+}
+
+static inline uint64_t get_varint(const uint8_t*& p, const uint8_t* end) {
+        uint64_t v = 0;
+        for (unsigned int shift = 0; p < end && shift < 64; shift += 7) {
+                uint8_t b = *p++;
+                v |= (uint64_t) (b & 0x7f) << shift;
+                if (!(b & 0x80))
+                        return v;
+        }
+        throw std::runtime_error("Corrupt packed block");
+}
+
+/*
+ * pack_writer
+ */
+
+pack_writer::pack_writer(int fd, uint32_t block_records) :
+        fd(fd), block_records(block_records), offset(0), rec_idx(0),
+        time_offset(0), block_time_offset(0), finished(false)
+{
+        if (block_records == 0)
+                throw std::runtime_error("Block must hold at least one record");
+        pending.reserve(block_records);
+
+        pack_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, PACK_MAGIC, 4);
+        hdr.version = PACK_VERSION;
+        hdr.block_records = block_records;
+        write_bytes(&hdr, sizeof(hdr));
+}
+
+pack_writer::~pack_writer() {
+        if (!finished) {
+                try {
+                        finish();
+                } catch (std::runtime_error& e) {
+                        fprintf(stderr, "Error finishing packed file: %s\n", e.what());
+                }
+        }
+}
+
+void pack_writer::write_bytes(const void* data, size_t len) {
+        const uint8_t* p = (const uint8_t*) data;
+        while (len > 0) {
+                ssize_t res = ::write(fd, p, len);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        throw std::runtime_error("Error writing packed records");
+                }
+                p += res;
+                len -= res;
+                offset += res;
+        }
+}
+
+void pack_writer::add(const record* recs, size_t n) {
+        for (size_t i=0; i<n; i++) {
+                pending.push_back(recs[i].data);
+                time_offset = recs[i].time_offset;
+                if (pending.size() == block_records) {
+                        write_block();
+                        block_time_offset = time_offset;
+                }
+        }
+}
+
+void pack_writer::write_block() {
+        if (pending.empty())
+                return;
+
+        pack_block_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, PACK_BLOCK_MAGIC, 4);
+        hdr.n_records = pending.size();
+        hdr.first = pending[0];
+
+        bool packable = true;
+        for (auto r = pending.begin(); r != pending.end(); r++)
+                packable &= (*r & RESERVED_MASK) == 0;
+
+        out.clear();
+        if (packable) {
+                hdr.type = BLOCK_PACKED;
+
+                // Symbols
+                for (size_t i = 0; i < pending.size(); ) {
+                        uint8_t sym = record_symbol(pending[i]);
+                        size_t run = 1;
+                        while (i + run < pending.size() && record_symbol(pending[i+run]) == sym)
+                                run++;
+                        if (run > 1) {
+                                out.push_back(sym | 0x80);
+                                put_varint(out, run - 2);
+                        } else {
+                                out.push_back(sym);
+                        }
+                        i += run;
+                }
+                hdr.symbol_bytes = out.size();
+
+                // Timestamp deltas
+                for (size_t i = 1; i < pending.size(); i++)
+                        put_varint(out, (pending[i] - pending[i-1]) & TIME_MASK);
+        } else {
+                hdr.type = BLOCK_RAW;
+                out.resize(pending.size()*RECORD_LENGTH + 2);
+                for (size_t i = 0; i < pending.size(); i++)
+                        record_writer::encode(pending[i], &out[i*RECORD_LENGTH]);
+                out.resize(pending.size()*RECORD_LENGTH);
+        }
+        hdr.payload_bytes = out.size();
+
+        pack_index_entry e = { offset, rec_idx, block_time_offset };
+        index.push_back(e);
+
+        write_bytes(&hdr, sizeof(hdr));
+        write_bytes(&out[0], out.size());
+        rec_idx += pending.size();
+        pending.clear();
+}
+
+void pack_writer::finish() {
+        write_block();
+
+        pack_footer footer;
+        memset(&footer, 0, sizeof(footer));
+        footer.index_offset = offset;
+        memcpy(footer.magic, PACK_FOOTER_MAGIC, 4);
+
+        pack_index_header hdr;
+        memcpy(hdr.magic, PACK_INDEX_MAGIC, 4);
+        hdr.n_blocks = index.size();
+        write_bytes(&hdr, sizeof(hdr));
+        if (!index.empty())
+                write_bytes(&index[0], index.size() * sizeof(pack_index_entry));
+        write_bytes(&footer, sizeof(footer));
+        finished = true;
+}
+
+/*
+ * pack_reader
+ */
+
+pack_reader::pack_reader(int fd, const uint8_t* prefix, size_t prefix_len) :
+        fd(fd), in(std::max<size_t>(prefix_len, 1 << 16)), in_head(0), in_tail(prefix_len),
+        at_end(false)
+{
+        memcpy(&in[0], prefix, prefix_len);
+
+        pack_header hdr;
+        if (!read_exact(&hdr, sizeof(hdr))
+            || memcmp(hdr.magic, PACK_MAGIC, 4) != 0
+            || hdr.version != PACK_VERSION)
+                throw std::runtime_error("Invalid packed file header");
+}
+
+bool pack_reader::read_exact(void* dest, size_t len) {
+        uint8_t* d = (uint8_t*) dest;
+        while (len > 0) {
+                if (in_head == in_tail) {
+                        ssize_t res = read(fd, &in[0], in.size());
+                        if (res < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                throw std::runtime_error("Error reading packed records");
+                        } else if (res == 0) {
+                                return false;
+                        }
+                        in_head = 0;
+                        in_tail = res;
+                }
+                size_t m = std::min(len, in_tail - in_head);
+                memcpy(d, &in[in_head], m);
+                in_head += m;
+                d += m;
+                len -= m;
+        }
+        return true;
+}
+
+size_t pack_reader::read_block(std::vector<uint8_t>& out) {
+        if (at_end)
+                return 0;
+
+        pack_block_header hdr;
+        if (!read_exact(hdr.magic, 4))
+                throw std::runtime_error("Truncated packed file");
+        if (memcmp(hdr.magic, PACK_INDEX_MAGIC, 4) == 0) {
+                at_end = true;
+                return 0;
+        }
+        if (memcmp(hdr.magic, PACK_BLOCK_MAGIC, 4) != 0
+            || !read_exact((uint8_t*) &hdr + 4, sizeof(hdr) - 4))
+                throw std::runtime_error("Corrupt packed file");
+
+        payload.resize(hdr.payload_bytes);
+        if (!read_exact(&payload[0], hdr.payload_bytes))
+                throw std::runtime_error("Truncated packed file");
+
+        size_t n = hdr.n_records;
+        if (out.size() < n*RECORD_LENGTH + 2)
+                out.resize(n*RECORD_LENGTH + 2);
+
+        if (hdr.type == BLOCK_RAW) {
+                if (hdr.payload_bytes != n*RECORD_LENGTH)
+                        throw std::runtime_error("Corrupt packed block");
+                memcpy(&out[0], &payload[0], hdr.payload_bytes);
+                return n;
+        }
+
+        const uint8_t* p = &payload[0];
+        const uint8_t* sym_end = p + hdr.symbol_bytes;
+        const uint8_t* end = p + hdr.payload_bytes;
+        if (sym_end > end)
+                throw std::runtime_error("Corrupt packed block");
+
+        // Expand the symbols into the record buffer, filling in times below
+        size_t i = 0;
+        while (i < n) {
+                if (p >= sym_end)
+                        throw std::runtime_error("Corrupt packed block");
+                uint8_t sym = *p++;
+                uint64_t run = 1;
+                if (sym & 0x80)
+                        run = get_varint(p, sym_end) + 2;
+                if (run > n - i)
+                        throw std::runtime_error("Corrupt packed block");
+                record_t bits = symbol_bits(sym);
+                for (uint64_t j = 0; j < run; j++, i++)
+                        record_writer::encode(bits, &out[i*RECORD_LENGTH]);
+        }
+
+        record_t t = hdr.first & TIME_MASK;
+        p = sym_end;
+        for (i = 0; i < n; i++) {
+                if (i > 0)
+                        t = (t + get_varint(p, end)) & TIME_MASK;
+                uint8_t* d = &out[i*RECORD_LENGTH];
+                // The time occupies the low 36 bits of the big-endian record
+                d[1] |= t >> 32;
+                d[2] = t >> 24;
+                d[3] = t >> 16;
+                d[4] = t >> 8;
+                d[5] = t >> 0;
+        }
+        return n;
+}
+
+void pack_reader::load_index() {
+        struct stat st;
+        pack_footer footer;
+        if (fstat(fd, &st) || st.st_size < (off_t) sizeof(footer)
+            || pread(fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) != sizeof(footer)
+            || memcmp(footer.magic, PACK_FOOTER_MAGIC, 4) != 0)
+                throw std::runtime_error("Packed file has no block index");
+
+        pack_index_header hdr;
+        if (pread(fd, &hdr, sizeof(hdr), footer.index_offset) != sizeof(hdr)
+            || memcmp(hdr.magic, PACK_INDEX_MAGIC, 4) != 0)
+                throw std::runtime_error("Corrupt block index");
+
+        index.resize(hdr.n_blocks);
+        size_t len = hdr.n_blocks * sizeof(pack_index_entry);
+        if (len && pread(fd, &index[0], len, footer.index_offset + sizeof(hdr)) != (ssize_t) len)
+                throw std::runtime_error("Corrupt block index");
+}
+
+uint64_t pack_reader::seek(uint64_t rec_idx) {
+        if (index.empty())
+                load_index();
+
+        auto it = std::upper_bound(index.begin(), index.end(), rec_idx,
+                [](uint64_t idx, const pack_index_entry& e) { return idx < e.rec_idx; });
+        if (it == index.begin()) {
+                // Empty container
+                at_end = true;
+                return 0;
+        }
+        it--;
+
+        if (lseek(fd, it->offset, SEEK_SET) < 0)
+                throw std::runtime_error("Error seeking in packed file");
+        in_head = in_tail = 0;
+        at_end = false;
+        return rec_idx - it->rec_idx;
+}
@@ -0,0 +1,168 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#ifndef _RECORD_PACK_H
+#define _RECORD_PACK_H
+
+#include <cstdint>
+#include <vector>
+#include "record.h"
+
+/*
+ * Compressed archival container for records.
+ *
+ * A packed file begins with a pack_header followed by a sequence of
+ * independently decodable blocks, each a pack_block_header and its
+ * payload. A block holds the full first record followed by,
+ *
+ *   symbols:  The channel mask and flags of each record as a byte
+ *             (channels in bits 0-3, type, wrap and lost flags in bits
+ *             4-6), run-length coded: if bit 7 is set a varint giving
+ *             the run length less two follows.
+ *
+ *   deltas:   For each subsequent record a varint of the difference of
+ *             its raw timestamp from that of the preceding record, modulo
+ *             2^TIME_BITS.
+ *
+ * Blocks containing records with reserved bits set are stored unpacked.
+ *
+ * The blocks are followed by an index of the blocks (a pack_index_header
+ * and pack_index_entries) and a pack_footer giving its location, allowing
+ * readers to seek.
+ */
+
+/*
+ * record_stream recognizes packed input by its first four bytes matching
+ * PACK_MAGIC. This is only safe because the reserved record bits 40-44,
+ * in the first byte of an unpacked record, are always zero while the 'T'
+ * (0x54) leading the magic has bits 42 and 44 set. Should these bits ever
+ * be used, the format detection must change.
+ */
+#define PACK_MAGIC              "TTPK"
+#define PACK_BLOCK_MAGIC        "TTBK"
+#define PACK_INDEX_MAGIC        "TTPX"
+#define PACK_FOOTER_MAGIC       "TTPE"
+#define PACK_VERSION            1
+
+struct pack_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t block_records;
+        uint32_t reserved;
+};
+
+enum pack_block_type { BLOCK_RAW = 0, BLOCK_PACKED = 1 };
+
+struct pack_block_header {
+        char magic[4];
+        uint32_t type;
+        uint32_t n_records;
+        uint32_t payload_bytes;
+        uint32_t symbol_bytes;
+        uint32_t reserved;
+        record_t first;
+};
+
+struct pack_index_header {
+        char magic[4];
+        uint32_t n_blocks;
+};
+
+struct pack_index_entry {
+        uint64_t offset;        // Byte offset of the block header
+        uint64_t rec_idx;       // Index of the first record of the block
+        uint64_t time_offset;   // Wrap offset in effect at the preceding record
+};
+
+struct pack_footer {
+        uint64_t index_offset;
+        char magic[4];
+        uint32_t reserved;
+};
+
+/*
+ * Writes records into a packed container on a file descriptor. The
+ * descriptor need not be seekable.
+ */
+class pack_writer {
+        int fd;
+        uint32_t block_records;
+        std::vector<record_t> pending;
+        std::vector<uint8_t> out;
+        std::vector<pack_index_entry> index;
+        uint64_t offset, rec_idx;
+        uint64_t time_offset;           // Wrap offset of the last record added
+        uint64_t block_time_offset;     // ... and of the record preceding the pending block
+        bool finished;
+
+        void write_bytes(const void* data, size_t len);
+        void write_block();
+
+public:
+        static const uint32_t default_block_records = 1 << 14;
+
+        pack_writer(int fd, uint32_t block_records=default_block_records);
+        pack_writer(const pack_writer&) = delete;
+        pack_writer& operator=(const pack_writer&) = delete;
+        ~pack_writer();
+
+        void add(const record* recs, size_t n);
+        // Write out the final block and the block index
+        void finish();
+};
+
+/*
+ * Reads blocks from a packed container. Used by record_stream when it
+ * recognizes packed input.
+ */
+class pack_reader {
+        int fd;
+        std::vector<uint8_t> in;
+        size_t in_head, in_tail;
+        std::vector<uint8_t> payload;
+        std::vector<pack_index_entry> index;
+        bool at_end;
+
+        bool read_exact(void* dest, size_t len);
+        void load_index();
+
+public:
+        // prefix holds any bytes of the container already read from fd
+        pack_reader(int fd, const uint8_t* prefix, size_t prefix_len);
+
+        /*
+         * Decode the next block into out in unpacked form, resizing it if
+         * necessary. Returns the number of records or zero at the end of
+         * the container.
+         */
+        size_t read_block(std::vector<uint8_t>& out);
+
+        /*
+         * Position the reader at the block containing record rec_idx,
+         * returning the number of records of the block preceding it.
+         * Requires a seekable descriptor.
+         */
+        uint64_t seek(uint64_t rec_idx);
+};
+
+#endif
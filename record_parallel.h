@@ -0,0 +1,111 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#ifndef _RECORD_PARALLEL_H
+#define _RECORD_PARALLEL_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "record.h"
+
+/*
+ * Parallel decoding of a record_file.
+ *
+ * Resolving timer wraps is inherently serial: the time of a record
+ * depends upon the number of wrap records preceding it. We work around
+ * this by splitting the file into chunks and first counting the wrap
+ * flags of each chunk in parallel. A prefix sum over these counts gives
+ * the wrap offset at the beginning of each chunk, after which the chunks
+ * can be decoded concurrently.
+ *
+ * To bound memory use and keep data in the page cache between the two
+ * passes, chunks are processed in rounds of one chunk per thread.
+ */
+
+struct record_chunk {
+        size_t index;           // Index of the chunk
+        size_t start, end;      // Records [start, end)
+        uint64_t time_offset;   // Wrap offset in effect at record start-1
+};
+
+/*
+ * Process records [start, file.size()) of file on n_threads threads.
+ * time_offset is the wrap offset in effect at record start-1.
+ *
+ *   process(slot, chunk) is called on a worker thread for each chunk.
+ *   slot identifies the thread's position in the round, in
+ *   [0, n_threads), and may be used to index per-thread state.
+ *
+ *   merge(slot, chunk) is called on the calling thread for each chunk,
+ *   in order, once its round has finished.
+ */
+template<typename Process, typename Merge>
+void parallel_process(const record_file& file, size_t start, uint64_t time_offset,
+                      unsigned int n_threads, Process process, Merge merge,
+                      size_t chunk_records = 1 << 22)
+{
+        const uint64_t wrap_offset = (1ULL<<TIME_BITS) - 1;
+        n_threads = std::max(n_threads, 1U);
+        size_t index = 0;
+        std::vector<record_chunk> chunks(n_threads);
+        std::vector<uint64_t> wraps(n_threads);
+        std::vector<std::thread> threads;
+
+        while (start < file.size()) {
+                unsigned int n = 0;
+                for (; n < n_threads && start < file.size(); n++) {
+                        size_t end = std::min(start + chunk_records, file.size());
+                        chunks[n] = { index++, start, end, 0 };
+                        start = end;
+                }
+
+                // Count wraps
+                for (unsigned int i = 0; i < n; i++) {
+                        threads.emplace_back([&, i]() {
+                                wraps[i] = file.count_wraps(chunks[i].start, chunks[i].end);
+                        });
+                }
+                for (auto t = threads.begin(); t != threads.end(); t++)
+                        t->join();
+                threads.clear();
+
+                // Prefix sum
+                for (unsigned int i = 0; i < n; i++) {
+                        chunks[i].time_offset = time_offset;
+                        time_offset += wraps[i] * wrap_offset;
+                }
+
+                // Decode
+                for (unsigned int i = 0; i < n; i++)
+                        threads.emplace_back([&, i]() { process(i, chunks[i]); });
+                for (auto t = threads.begin(); t != threads.end(); t++)
+                        t->join();
+                threads.clear();
+
+                for (unsigned int i = 0; i < n; i++)
+                        merge(i, chunks[i]);
+        }
+}
+
+#endif
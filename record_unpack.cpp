@@ -0,0 +1,223 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+#include <cstring>
+#include "record_unpack.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+ * Scalar implementation
+ */
+
+static inline record_t load_record(const uint8_t* d) {
+        return ((record_t) d[0] << 40) | ((record_t) d[1] << 32)
+             | ((record_t) d[2] << 24) | ((record_t) d[3] << 16)
+             | ((record_t) d[4] << 8)  | ((record_t) d[5] << 0);
+}
+
+void unpack_raw_scalar(const uint8_t* in, size_t n, record_t* out) {
+        for (size_t i=0; i<n; i++, in += RECORD_LENGTH)
+                out[i] = load_record(in);
+}
+
+void unpack_records_scalar(const uint8_t* in, size_t n, uint64_t* times,
+                           uint8_t* channels, uint8_t* flags, unpack_state& state) {
+        for (size_t i=0; i<n; i++, in += RECORD_LENGTH) {
+                record_t v = load_record(in);
+                state.rec_idx++;
+                if (state.rec_idx > 1 && (v & TIMER_WRAP_MASK))
+                        state.time_offset += (1ULL<<TIME_BITS) - 1;
+                times[i] = (v & TIME_MASK) + state.time_offset;
+                channels[i] = (v & CHANNEL_MASK) >> TIME_BITS;
+                flags[i] = v >> 45;
+        }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+ * The vector kernels work on four records (24 bytes) at a time, loaded as
+ * two 16 byte halves each holding two records. A byte shuffle reverses
+ * each record into a little-endian 64-bit lane. Since the second load
+ * reads four bytes past the last record, at least five records must
+ * remain for each step.
+ *
+ * The channel and flag bytes of each lane are then gathered with a second
+ * shuffle and split apart four records at a time in a general purpose
+ * register. Blocks containing a wrap record are left to the scalar code.
+ */
+
+/*
+ * Combine the gathered bytes [c0 c1 f0 f1] and [c2 c3 f2 f3] of two pairs
+ * of records into the channel and flag arrays.
+ */
+static inline void store_channels_flags(uint32_t lo, uint32_t hi, uint8_t* channels, uint8_t* flags) {
+        uint32_t c = (lo & 0xffff) | (hi << 16);
+        uint32_t f = (lo >> 16) | (hi & 0xffff0000);
+        c = (c >> 4) & 0x0f0f0f0f;
+        f = (f >> 5) & 0x07070707;
+        memcpy(channels, &c, 4);
+        memcpy(flags, &f, 4);
+}
+
+#define BSWAP_RECORDS   5,4,3,2,1,0,-1,-1, 11,10,9,8,7,6,-1,-1
+#define GATHER_BYTES    4,12,5,13, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1
+
+__attribute__((target("ssse3")))
+static void unpack_raw_ssse3(const uint8_t* in, size_t n, record_t* out) {
+        const __m128i bswap = _mm_setr_epi8(BSWAP_RECORDS);
+        size_t i = 0;
+        for (; i + 5 <= n; i += 4) {
+                const uint8_t* p = in + i*RECORD_LENGTH;
+                __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) p), bswap);
+                __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p+12)), bswap);
+                _mm_storeu_si128((__m128i*) &out[i], a);
+                _mm_storeu_si128((__m128i*) &out[i+2], b);
+        }
+        unpack_raw_scalar(in + i*RECORD_LENGTH, n - i, out + i);
+}
+
+__attribute__((target("ssse3")))
+static void unpack_records_ssse3(const uint8_t* in, size_t n, uint64_t* times,
+                                 uint8_t* channels, uint8_t* flags, unpack_state& state) {
+        const __m128i bswap = _mm_setr_epi8(BSWAP_RECORDS);
+        const __m128i gather = _mm_setr_epi8(GATHER_BYTES);
+        const __m128i time_mask = _mm_set1_epi64x(TIME_MASK);
+        const __m128i wrap_mask = _mm_set1_epi64x(TIMER_WRAP_MASK);
+        const __m128i zero = _mm_setzero_si128();
+
+        size_t i = 0;
+        // The wrap flag of the first record is ignored
+        if (state.rec_idx == 0 && n > 0) {
+                unpack_records_scalar(in, 1, times, channels, flags, state);
+                i = 1;
+        }
+
+        __m128i offset = _mm_set1_epi64x(state.time_offset);
+        for (; i + 5 <= n; i += 4) {
+                const uint8_t* p = in + i*RECORD_LENGTH;
+                __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) p), bswap);
+                __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p+12)), bswap);
+
+                __m128i wraps = _mm_and_si128(_mm_or_si128(a, b), wrap_mask);
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(wraps, zero)) != 0xffff) {
+                        unpack_records_scalar(p, 4, &times[i], &channels[i], &flags[i], state);
+                        offset = _mm_set1_epi64x(state.time_offset);
+                        continue;
+                }
+
+                _mm_storeu_si128((__m128i*) &times[i], _mm_add_epi64(_mm_and_si128(a, time_mask), offset));
+                _mm_storeu_si128((__m128i*) &times[i+2], _mm_add_epi64(_mm_and_si128(b, time_mask), offset));
+                store_channels_flags(_mm_cvtsi128_si32(_mm_shuffle_epi8(a, gather)),
+                                     _mm_cvtsi128_si32(_mm_shuffle_epi8(b, gather)),
+                                     &channels[i], &flags[i]);
+                state.rec_idx += 4;
+        }
+        unpack_records_scalar(in + i*RECORD_LENGTH, n - i, &times[i], &channels[i], &flags[i], state);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i load_records_avx2(const uint8_t* p) {
+        const __m256i bswap = _mm256_setr_epi8(BSWAP_RECORDS, BSWAP_RECORDS);
+        __m256i v = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) p));
+        v = _mm256_inserti128_si256(v, _mm_loadu_si128((const __m128i*) (p+12)), 1);
+        return _mm256_shuffle_epi8(v, bswap);
+}
+
+__attribute__((target("avx2")))
+static void unpack_raw_avx2(const uint8_t* in, size_t n, record_t* out) {
+        size_t i = 0;
+        for (; i + 5 <= n; i += 4)
+                _mm256_storeu_si256((__m256i*) &out[i], load_records_avx2(in + i*RECORD_LENGTH));
+        unpack_raw_scalar(in + i*RECORD_LENGTH, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static void unpack_records_avx2(const uint8_t* in, size_t n, uint64_t* times,
+                                uint8_t* channels, uint8_t* flags, unpack_state& state) {
+        const __m256i gather = _mm256_setr_epi8(GATHER_BYTES, GATHER_BYTES);
+        const __m256i time_mask = _mm256_set1_epi64x(TIME_MASK);
+        const __m256i wrap_mask = _mm256_set1_epi64x(TIMER_WRAP_MASK);
+
+        size_t i = 0;
+        // The wrap flag of the first record is ignored
+        if (state.rec_idx == 0 && n > 0) {
+                unpack_records_scalar(in, 1, times, channels, flags, state);
+                i = 1;
+        }
+
+        __m256i offset = _mm256_set1_epi64x(state.time_offset);
+        for (; i + 5 <= n; i += 4) {
+                const uint8_t* p = in + i*RECORD_LENGTH;
+                __m256i v = load_records_avx2(p);
+
+                if (!_mm256_testz_si256(v, wrap_mask)) {
+                        unpack_records_scalar(p, 4, &times[i], &channels[i], &flags[i], state);
+                        offset = _mm256_set1_epi64x(state.time_offset);
+                        continue;
+                }
+
+                _mm256_storeu_si256((__m256i*) &times[i], _mm256_add_epi64(_mm256_and_si256(v, time_mask), offset));
+                __m256i cf = _mm256_shuffle_epi8(v, gather);
+                store_channels_flags(_mm256_extract_epi32(cf, 0), _mm256_extract_epi32(cf, 4),
+                                     &channels[i], &flags[i]);
+                state.rec_idx += 4;
+        }
+        unpack_records_scalar(in + i*RECORD_LENGTH, n - i, &times[i], &channels[i], &flags[i], state);
+}
+
+#endif
+
+/*
+ * Runtime dispatch
+ */
+
+std::vector<unpack_kernel> unpack_kernels() {
+        std::vector<unpack_kernel> kernels;
+#ifdef HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                kernels.push_back({ "avx2", unpack_raw_avx2, unpack_records_avx2 });
+        if (__builtin_cpu_supports("ssse3"))
+                kernels.push_back({ "ssse3", unpack_raw_ssse3, unpack_records_ssse3 });
+#endif
+        kernels.push_back({ "scalar", unpack_raw_scalar, unpack_records_scalar });
+        return kernels;
+}
+
+static const unpack_kernel& get_kernel() {
+        static const unpack_kernel kernel = unpack_kernels().front();
+        return kernel;
+}
+
+void unpack_raw(const uint8_t* in, size_t n, record_t* out) {
+        get_kernel().raw(in, n, out);
+}
+
+void unpack_records(const uint8_t* in, size_t n, uint64_t* times,
+                    uint8_t* channels, uint8_t* flags, unpack_state& state) {
+        get_kernel().records(in, n, times, channels, flags, state);
+}
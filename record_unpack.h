@@ -0,0 +1,84 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#ifndef _RECORD_UNPACK_H
+#define _RECORD_UNPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "record_format.h"
+
+/*
+ * Decoding of blocks of packed records into separate timestamp, channel
+ * and flag arrays. An SSSE3 or AVX2 kernel is selected at runtime when the
+ * CPU supports it, otherwise a scalar implementation is used.
+ */
+
+// Bits of the flags array, in the same order as in the record
+#define UNPACK_FLAG_DELTA       (REC_TYPE_MASK >> 45)
+#define UNPACK_FLAG_WRAP        (TIMER_WRAP_MASK >> 45)
+#define UNPACK_FLAG_LOST        (LOST_SAMPLE_MASK >> 45)
+
+/*
+ * Wrap resolution state carried from one block to the next. rec_idx
+ * counts the records decoded so far.
+ */
+struct unpack_state {
+        uint64_t time_offset;
+        uint64_t rec_idx;
+        unpack_state(uint64_t time_offset=0, uint64_t rec_idx=0)
+                : time_offset(time_offset), rec_idx(rec_idx) { }
+};
+
+// Byte-swap n packed records into record_t words
+void unpack_raw(const uint8_t* in, size_t n, record_t* out);
+
+/*
+ * Decode n packed records. times receives wrap-resolved timestamps,
+ * channels the channel mask and flags the UNPACK_FLAG_* bits.
+ */
+void unpack_records(const uint8_t* in, size_t n, uint64_t* times,
+                    uint8_t* channels, uint8_t* flags, unpack_state& state);
+
+// The scalar implementations, used for the tail of each block
+void unpack_raw_scalar(const uint8_t* in, size_t n, record_t* out);
+void unpack_records_scalar(const uint8_t* in, size_t n, uint64_t* times,
+                           uint8_t* channels, uint8_t* flags, unpack_state& state);
+
+typedef void (*unpack_raw_fn)(const uint8_t*, size_t, record_t*);
+typedef void (*unpack_records_fn)(const uint8_t*, size_t, uint64_t*, uint8_t*, uint8_t*, unpack_state&);
+
+struct unpack_kernel {
+        const char* name;
+        unpack_raw_fn raw;
+        unpack_records_fn records;
+};
+
+/*
+ * The kernels this CPU supports, the one used by unpack_raw() and
+ * unpack_records() first and the scalar implementation last
+ */
+std::vector<unpack_kernel> unpack_kernels();
+
+#endif
@@ -0,0 +1,120 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+
+#ifndef _SPSC_RING_H
+#define _SPSC_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * A preallocated ring of fixed-size buffers passed from one producer
+ * thread to one consumer thread without locks.
+ *
+ * The producer never waits: data which does not fit in the free slots is
+ * dropped and counted as an overflow. The high-water mark records the
+ * greatest number of slots ever in use, which tells how close the
+ * consumer has come to falling behind.
+ */
+class spsc_ring {
+        const size_t n_slots, slot_size;
+        std::vector<uint8_t> storage;
+        std::vector<size_t> lengths;
+
+        // Slots ever filled and ever consumed; head - tail are in use
+        std::atomic<uint64_t> head, tail;
+        std::atomic<uint64_t> high_water, overflows, dropped;
+
+public:
+        spsc_ring(size_t n_slots, size_t slot_size)
+                : n_slots(n_slots), slot_size(slot_size),
+                  storage(n_slots * slot_size), lengths(n_slots),
+                  head(0), tail(0), high_water(0), overflows(0), dropped(0) { }
+
+        spsc_ring(const spsc_ring&) = delete;
+        spsc_ring& operator=(const spsc_ring&) = delete;
+
+        /*
+         * Copy length bytes into the ring, in as many slots as needed. The
+         * caller chooses slot_size such that data is split only where it
+         * may be. Returns false if some of it was dropped. Producer only.
+         */
+        bool push(const uint8_t* data, size_t length) {
+                uint64_t h = head.load(std::memory_order_relaxed);
+                uint64_t t = tail.load(std::memory_order_acquire);
+                while (length > 0) {
+                        if (h - t == n_slots) {
+                                overflows.fetch_add(1, std::memory_order_relaxed);
+                                dropped.fetch_add(length, std::memory_order_relaxed);
+                                break;
+                        }
+                        size_t n = std::min(length, slot_size);
+                        size_t slot = h % n_slots;
+                        memcpy(&storage[slot * slot_size], data, n);
+                        lengths[slot] = n;
+                        data += n;
+                        length -= n;
+                        h++;
+                }
+                head.store(h, std::memory_order_release);
+
+                if (h - t > high_water.load(std::memory_order_relaxed))
+                        high_water.store(h - t, std::memory_order_relaxed);
+                return length == 0;
+        }
+
+        /*
+         * The oldest filled slot and its length, or NULL if the ring is
+         * empty. The slot stays valid until pop(). Consumer only.
+         */
+        const uint8_t* front(size_t& length) const {
+                uint64_t t = tail.load(std::memory_order_relaxed);
+                if (head.load(std::memory_order_acquire) == t)
+                        return NULL;
+                size_t slot = t % n_slots;
+                length = lengths[slot];
+                return &storage[slot * slot_size];
+        }
+
+        // Release the slot returned by front(). Consumer only.
+        void pop() {
+                tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // These may be read from any thread
+        size_t size() const { return n_slots; }
+        size_t occupancy() const {
+                // Read tail first so that it can never appear ahead of head
+                uint64_t t = tail.load(std::memory_order_acquire);
+                return head.load(std::memory_order_acquire) - t;
+        }
+        uint64_t get_high_water() const { return high_water.load(std::memory_order_relaxed); }
+        uint64_t get_overflows() const { return overflows.load(std::memory_order_relaxed); }
+        uint64_t get_dropped() const { return dropped.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -40,6 +40,7 @@
 #include <boost/lexical_cast.hpp>
 
 #include <atomic>
+#include <chrono>
 #include <thread>
 #include <condition_variable>
 #include <mutex>
@@ -49,11 +50,18 @@
 
 #include "timetagger.h"
 #include "record_format.h"
+#include "spsc_ring.h"
+#include "buffer_pool.h"
+#include "disk_writer.h"
 
 #define VENDOR_ID 0x04b4
 #define PRODUCT_ID 0x1004
 
 #define MAX_CTRL_MSG_LEN 256
+// Default number of readout batches buffered for the data socket
+#define DATA_POOL_BUFFERS 256
+// Default interval between refreshes of the status snapshot in seconds
+#define STATUS_INTERVAL 1.0
 
 class timetag_acquire {
         struct buffer {
@@ -65,24 +73,73 @@ class timetag_acquire {
         };
 
         timetagger t;
+
+        /*
+         * Records are passed from the readout thread to the publisher
+         * thread in a pool of buffers, which are sent without copying and
+         * returned to the pool once ZeroMQ is done with them. Neither a
+         * stall in ZeroMQ nor a slow subscriber can hold up readout: should
+         * the pool run dry, records are dropped and counted instead. The
+         * pool must outlive the ZeroMQ context, which may release messages
+         * until it is destroyed.
+         */
+        std::shared_ptr<buffer_pool> data_pool;
+        std::atomic<bool> stop_publish;
+        std::thread publisher;
+
         zmq::context_t zmq_ctx;
         zmq::socket_t ctrl_sock;  // used from command loop
-        zmq::socket_t data_sock;  // used only from data_callback
+        zmq::socket_t data_sock;  // used only from publisher thread
         zmq::socket_t event_sock; // used from command loop
 
+        /*
+         * Direct-to-disk recording takes records from the readout thread
+         * through a ring of its own, so that it neither waits on nor is
+         * held up by subscribers to the data socket.
+         */
+        std::shared_ptr<spsc_ring> record_ring;
+        std::shared_ptr<disk_writer> recorder;
+        std::atomic<bool> recording;
+        disk_writer_config record_config;
+
+        /*
+         * The counters and capture state are refreshed in the background
+         * so that status? can answer from the register cache, keeping
+         * polling clients off the USB bus.
+         */
+        double status_interval;
+        std::mutex status_lock;
+        std::condition_variable status_cond;
+        bool stop_status;
+        std::thread status_poller;
+
+        void publish();
+        void poll_status();
         std::string handle_command(std::string line);
 
 public:
         void listen();
 
-        timetag_acquire(libusb_context* ctx, libusb_device_handle* dev)
+        timetag_acquire(libusb_context* ctx, libusb_device_handle* dev,
+                        unsigned int n_transfers, unsigned int transfer_size,
+                        unsigned int pool_buffers, double status_interval)
                 : t(ctx, dev, [=](const uint8_t* buffer, size_t length) {
-                           this->data_sock.send(buffer, length);
+                           uint8_t* buf = this->data_pool->acquire(length);
+                           if (buf != NULL) {
+                                   memcpy(buf, buffer, length);
+                                   this->data_pool->commit(length);
+                           }
+                           if (this->recording)
+                                   this->record_ring->push(buffer, length);
                    }),
+                  stop_publish(false),
                   zmq_ctx(),
                   ctrl_sock(this->zmq_ctx, ZMQ_REP),
                   data_sock(this->zmq_ctx, ZMQ_PUB),
-                  event_sock(this->zmq_ctx, ZMQ_PUB)
+                  event_sock(this->zmq_ctx, ZMQ_PUB),
+                  recording(false),
+                  status_interval(std::max(status_interval, 0.01)),
+                  stop_status(false)
         {
                 this->ctrl_sock.bind("ipc:///tmp/timetag-ctrl");
                 this->data_sock.bind("ipc:///tmp/timetag-data");
@@ -96,12 +153,31 @@ public:
                 chmod("/tmp/timetag-event", mode);
 
                 t.reset_counter();
+                t.set_readout_transfers(n_transfers);
+                t.set_readout_transfer_size(transfer_size);
+
+                // A buffer holds the whole records of one transfer
+                size_t buf_size = RECORD_LENGTH * (t.get_readout_transfer_size() / RECORD_LENGTH + 1);
+                data_pool = std::make_shared<buffer_pool>(std::max(1U, pool_buffers), buf_size);
+                record_ring = std::make_shared<spsc_ring>(std::max(1U, pool_buffers), buf_size);
+                publisher = std::thread(&timetag_acquire::publish, this);
+                status_poller = std::thread(&timetag_acquire::poll_status, this);
                 t.start_readout();
         }
 
         ~timetag_acquire()
         {
                 t.stop_readout();
+                recording = false;
+                recorder.reset();
+                stop_publish = true;
+                publisher.join();
+                {
+                        std::lock_guard<std::mutex> lock(status_lock);
+                        stop_status = true;
+                }
+                status_cond.notify_one();
+                status_poller.join();
         }
 };
 
@@ -130,6 +206,35 @@ void timetag_acquire::listen()
         }
 }
 
+void timetag_acquire::publish()
+{
+        while (!stop_publish) {
+                size_t length;
+                uint8_t* buf = data_pool->take(length);
+                if (buf == NULL) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        continue;
+                }
+                zmq::message_t msg(buf, length, buffer_pool::zmq_free, data_pool.get());
+                this->data_sock.send(msg);
+        }
+}
+
+void timetag_acquire::poll_status()
+{
+        std::unique_lock<std::mutex> lock(status_lock);
+        while (!stop_status) {
+                status_cond.wait_for(lock, std::chrono::duration<double>(status_interval));
+                if (stop_status)
+                        break;
+                try {
+                        t.refresh_status();
+                } catch (std::exception& e) {
+                        fprintf(log_file, "Error refreshing status: %s\n", e.what());
+                }
+        }
+}
+
 /*
  * Return whether to stop
  */
@@ -238,6 +343,100 @@ std::string timetag_acquire::handle_command(std::string line)
                         [&]() { response << t.get_lost_record_count(); },
                         "Display current lost record count"
                 },
+                {"record_start", 1,
+                        [&]() {
+                                if (recorder) {
+                                        response << "error: already recording";
+                                        return;
+                                }
+                                // Discard anything pushed as the last recording stopped
+                                size_t length;
+                                while (record_ring->front(length))
+                                        record_ring->pop();
+                                recorder = std::make_shared<disk_writer>(*record_ring, tokens[1], record_config);
+                                recording = true;
+                                response << "ok";
+                                const char event[] = "record start";
+                                event_sock.send(event, sizeof(event));
+                        },
+                        "Start recording records to a file",
+                        "PATH"
+                },
+                {"record_stop", 0,
+                        [&]() {
+                                recording = false;
+                                recorder.reset();
+                                response << "ok";
+                                const char event[] = "record stop";
+                                event_sock.send(event, sizeof(event));
+                        },
+                        "Stop recording, writing out all records received until now"
+                },
+                {"record?", 0,
+                        [&]() {
+                                if (!recorder)
+                                        response << "none";
+                                else if (recorder->has_failed())
+                                        response << "error";
+                                else
+                                        response << recorder->current_path() << " "
+                                                 << recorder->bytes_written() << " "
+                                                 << record_ring->get_dropped() / RECORD_LENGTH;
+                        },
+                        "Display the file being recorded to, bytes written and records dropped"
+                },
+                {"record_config", 3,
+                        [&]() {
+                                record_config.rotate_bytes = lexical_cast<uint64_t>(tokens[1]);
+                                record_config.rotate_secs = lexical_cast<double>(tokens[2]);
+                                record_config.fsync_secs = lexical_cast<double>(tokens[3]);
+                                response << "ok";
+                        },
+                        "Configure file rotation and syncing of the next recording (0 to disable)",
+                        "ROTATE_BYTES ROTATE_SECS FSYNC_SECS"
+                },
+                {"status?", 0,
+                        [&]() {
+                                timetagger::status s = t.get_status();
+                                std::chrono::duration<double> age = std::chrono::steady_clock::now() - s.time;
+                                response << "age=" << age.count()
+                                         << " version=" << s.version
+                                         << " clockrate=" << s.clockrate
+                                         << " capture=" << s.capture_en
+                                         << " record_count=" << s.record_count
+                                         << " lost_record_count=" << s.lost_record_count
+                                         << " strobe_operate=" << (int) s.strobe_operate
+                                         << " delta_operate=" << (int) s.delta_operate
+                                         << " seq_operate=" << s.seq_operate
+                                         << " seq_clockrate=" << s.seq_clockrate;
+                                for (int i=0; i<TIMETAG_NSEQCHANS; i++) {
+                                        response << " seqchan" << i << "="
+                                                 << s.seqchans[i].operate << ","
+                                                 << s.seqchans[i].initial_state << ","
+                                                 << s.seqchans[i].initial_count << ","
+                                                 << s.seqchans[i].low_count << ","
+                                                 << s.seqchans[i].high_count;
+                                }
+                                response << " recording=" << (recorder != NULL)
+                                         << " dropped_records=" << data_pool->get_dropped() / RECORD_LENGTH;
+                        },
+                        "Display a snapshot of the device's state, refreshed periodically, as KEY=VALUE pairs. "
+                        "strobe_operate and delta_operate are channel masks; "
+                        "seqchanN gives OPERATE,INITIAL_STATE,INITIAL_COUNT,LOW_COUNT,HIGH_COUNT"
+                },
+                {"data_pool?", 0,
+                        [&]() {
+                                response << data_pool->get_in_use() << " "
+                                         << data_pool->get_high_water() << " "
+                                         << data_pool->size() << " "
+                                         << data_pool->get_sent() << " "
+                                         << data_pool->get_exhausted() << " "
+                                         << data_pool->get_dropped() / RECORD_LENGTH;
+                        },
+                        "Display buffers of the data pool in use, their high-water mark and the pool size, "
+                        "followed by the number of messages sent, of times the pool ran dry "
+                        "and of records dropped"
+                },
                 {"seq_clockrate?", 0,
                         [&]() { response << t.get_seq_clockrate(); },
                         "Display sequencer clockrate"
@@ -291,10 +490,8 @@ std::string timetag_acquire::handle_command(std::string line)
                                 int initial_count = lexical_cast<int>(tokens[3]);
                                 int low_count = lexical_cast<int>(tokens[4]);
                                 int high_count = lexical_cast<int>(tokens[5]);
-                                t.set_seqchan_initial_state(channel, initial_state);
-                                t.set_seqchan_initial_count(channel, initial_count);
-                                t.set_seqchan_low_count(channel, low_count);
-                                t.set_seqchan_high_count(channel, high_count);
+                                t.set_seqchan_config(channel, initial_state, initial_count,
+                                                     low_count, high_count);
                                 response << "ok";
                         },
                         "Configure sequencer channel",
@@ -386,6 +583,14 @@ static void print_usage()
         printf("arguments:\n");
         printf("  -s [SOCKET]    Listen on the given UNIX domain control socket\n");
         printf("  -d             Daemonize\n");
+        printf("  -n [N]         Keep N USB readout transfers queued (default %d)\n",
+               TIMETAG_READOUT_TRANSFERS);
+        printf("  -b [BYTES]     Size of each USB readout transfer (default %d)\n",
+               TIMETAG_READOUT_TRANSFER_SIZE);
+        printf("  -r [N]         Buffer up to N readout batches for publishing (default %d)\n",
+               DATA_POOL_BUFFERS);
+        printf("  -p [SECONDS]   Refresh the status? snapshot every SECONDS (default %g)\n",
+               STATUS_INTERVAL);
         printf("  -h             Display help message\n");
 }
 
@@ -395,9 +600,13 @@ int main(int argc, char** argv)
         libusb_device_handle* dev;
 
         bool daemon = false;
+        unsigned int n_transfers = TIMETAG_READOUT_TRANSFERS;
+        unsigned int transfer_size = TIMETAG_READOUT_TRANSFER_SIZE;
+        unsigned int pool_buffers = DATA_POOL_BUFFERS;
+        double status_interval = STATUS_INTERVAL;
         int c;
 
-        while ((c = getopt(argc, argv, "l:dh")) != -1) {
+        while ((c = getopt(argc, argv, "l:dn:b:r:p:h")) != -1) {
                 switch (c) {
                 case 'l':
                         log_file = fopen(optarg, "w");
@@ -405,6 +614,18 @@ int main(int argc, char** argv)
                 case 'd':
                         daemon = true;
                         break;
+                case 'n':
+                        n_transfers = atoi(optarg);
+                        break;
+                case 'b':
+                        transfer_size = atoi(optarg);
+                        break;
+                case 'r':
+                        pool_buffers = atoi(optarg);
+                        break;
+                case 'p':
+                        status_interval = atof(optarg);
+                        break;
                 case 'h':
                         print_usage();
                         exit(0);
@@ -453,7 +674,7 @@ int main(int argc, char** argv)
                 fprintf(log_file, "Couldn't find timetag user. Running as root.\n");
         }
 
-        timetag_acquire ta(ctx, dev);
+        timetag_acquire ta(ctx, dev, n_transfers, transfer_size, pool_buffers, status_interval);
         ta.listen();
 
         libusb_close(dev);
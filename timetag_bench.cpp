@@ -0,0 +1,512 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/program_options.hpp>
+#include "binner.h"
+#include "record.h"
+#include "record_index.h"
+#include "record_unpack.h"
+
+namespace po = boost::program_options;
+
+/*
+ * Measures the throughput of the record pipeline.
+ *
+ * Usage:
+ *   timetag_bench [--records N] [--dir DIR] [--tools DIR]
+ *   timetag_bench --check [--dir DIR] [--tools DIR]
+ *
+ * A deterministic synthetic capture is written to DIR for each of a
+ * fixed set of datasets. Each stage of the record pipeline is then timed
+ * on it in-process, followed by timetag_bin and timetag_cut (found in the
+ * tools directory) end to end.
+ *
+ * Output:
+ *   One tab-separated line per dataset and stage, preceded by a header,
+ *
+ *     dataset  stage  records  bytes  seconds  records_per_s  bytes_per_s
+ *
+ *   Stages named tool:... are end to end runs of a tool, including the
+ *   decoding measured separately by the read_records stage.
+ *
+ * With --check, nothing is timed. Instead the fast paths are compared
+ * against their reference implementations on synthetic data, printing a
+ * line for each check and exiting with failure if any disagree.
+ */
+
+#define CLOCK_RATE (30e6)
+
+struct dataset {
+        const char* name;
+        double rate;                    // Total strobe rate in Hz
+        std::array<double,4> weights;   // Relative rate of each strobe channel
+        double delta_period;            // Period of delta records in seconds, or 0
+};
+
+static const dataset datasets[] = {
+        { "low-1ch",    1e4, {{ 1, 0, 0, 0 }}, 0 },
+        { "mid-4ch",    1e6, {{ 1, 1, 1, 1 }}, 0 },
+        { "high-2ch",   5e6, {{ 3, 1, 0, 0 }}, 0 },
+        { "alex-2ch",   1e6, {{ 1, 1, 0, 0 }}, 50e-6 },
+};
+
+/*
+ * Write n records of the given dataset to path. Inter-arrival times are
+ * exponentially distributed and drawn from a fixed seed so that every
+ * run sees the same data.
+ */
+void generate(const dataset& ds, size_t n, const std::string& path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+                throw std::runtime_error("Error creating " + path);
+
+        std::mt19937_64 rng(0x7133);
+        auto uniform = [&]() { return (rng() >> 11) * (1.0 / (1ULL << 53)); };
+        double total = 0;
+        for (int c=0; c<4; c++)
+                total += ds.weights[c];
+
+        record_writer out(fd);
+        double t = 0, next_delta = ds.delta_period;
+        uint64_t last_time = 0;
+        unsigned int delta_state = 1;
+        for (size_t i=0; i<n; i++) {
+                record_t data;
+                t += -log(1 - uniform()) / ds.rate;
+                if (ds.delta_period > 0 && t >= next_delta) {
+                        t = next_delta;
+                        next_delta += ds.delta_period;
+                        delta_state ^= 3;
+                        data = REC_TYPE_MASK | ((record_t) delta_state << TIME_BITS);
+                } else {
+                        double u = uniform() * total;
+                        int c = 0;
+                        while (c < 3 && u >= ds.weights[c]) {
+                                u -= ds.weights[c];
+                                c++;
+                        }
+                        data = CHAN_0_MASK << c;
+                }
+
+                uint64_t time = t * CLOCK_RATE;
+                if ((time >> TIME_BITS) != (last_time >> TIME_BITS))
+                        data |= TIMER_WRAP_MASK;
+                last_time = time;
+                out.write(record(data | (time & TIME_MASK)));
+        }
+        out.flush();
+        close(fd);
+}
+
+struct timer {
+        std::chrono::steady_clock::time_point start;
+        timer() : start(std::chrono::steady_clock::now()) { }
+        double elapsed() const {
+                std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+                return d.count();
+        }
+};
+
+void report(const dataset& ds, const std::string& stage, size_t n, double secs) {
+        uint64_t bytes = (uint64_t) n * RECORD_LENGTH;
+        printf("%s\t%s\t%zu\t%lu\t%.6f\t%.0f\t%.0f\n", ds.name, stage.c_str(), n,
+               bytes, secs, n / secs, bytes / secs);
+        fflush(stdout);
+}
+
+/*
+ * Time a stage reading the dataset at path. The stage returns the
+ * number of records it processed.
+ */
+template<typename Stage>
+void run_stage(const dataset& ds, const std::string& stage, const std::string& path, Stage f) {
+        FILE* in = fopen(path.c_str(), "r");
+        if (in == NULL)
+                throw std::runtime_error("Error opening " + path);
+        timer t;
+        size_t n = f(in);
+        report(ds, stage, n, t.elapsed());
+        fclose(in);
+}
+
+// The standard output of a tool run on the file at path
+std::string tool_output(const std::string& tools, const std::string& args, const std::string& path) {
+        std::string cmd = tools + "/" + args + " < " + path;
+        FILE* p = popen(cmd.c_str(), "r");
+        if (p == NULL)
+                throw std::runtime_error("Error running " + cmd);
+        std::string out;
+        char buf[1 << 16];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), p)) > 0)
+                out.append(buf, n);
+        if (pclose(p) != 0)
+                throw std::runtime_error("Error running " + cmd);
+        return out;
+}
+
+bool report_check(const std::string& name, bool ok) {
+        printf("%s\t%s\n", ok ? "ok" : "FAIL", name.c_str());
+        fflush(stdout);
+        return ok;
+}
+
+/*
+ * Each unpack kernel must agree with the scalar implementation, on block
+ * lengths that aren't a multiple of the vector width, unaligned input,
+ * and records with the wrap, lost and delta flags set. Wraps are sparse
+ * so that the vector paths, which hand blocks with a wrap to the scalar
+ * code, are exercised too.
+ */
+unsigned int check_unpack_kernels() {
+        std::mt19937_64 rng(42);
+        const size_t n = 4099;
+        std::vector<uint8_t> in((n+1) * RECORD_LENGTH);
+        for (size_t i=0; i<n; i++) {
+                record_t r = rng() & ((1ULL << 48) - 1);
+                if (rng() % 32)
+                        r &= ~TIMER_WRAP_MASK;
+                for (int j=0; j<RECORD_LENGTH; j++)
+                        in[1 + i*RECORD_LENGTH + j] = r >> (8 * (RECORD_LENGTH-1-j));
+        }
+        const uint8_t* d = &in[1];
+
+        std::vector<size_t> lengths;
+        for (size_t m=0; m<=40; m++)
+                lengths.push_back(m);
+        lengths.push_back(1000);
+        lengths.push_back(n);
+
+        std::vector<record_t> raw(n), raw_ref(n);
+        std::vector<uint64_t> times(n), times_ref(n);
+        std::vector<uint8_t> chans(n), chans_ref(n), flags(n), flags_ref(n);
+        unsigned int failed = 0;
+        for (const unpack_kernel& k : unpack_kernels()) {
+                bool raw_ok = true, records_ok = true;
+                for (size_t m : lengths) {
+                        k.raw(d, m, &raw[0]);
+                        unpack_raw_scalar(d, m, &raw_ref[0]);
+                        raw_ok &= std::equal(raw.begin(), raw.begin() + m, raw_ref.begin());
+
+                        // Decode in blocks of m, carrying the wrap state between them
+                        for (uint64_t start_idx : { 0, 17 }) {
+                                unpack_state state(123, start_idx), state_ref(123, start_idx);
+                                for (size_t i=0; m > 0 && i < n; i += m) {
+                                        size_t l = std::min(m, n - i);
+                                        const uint8_t* p = d + i*RECORD_LENGTH;
+                                        k.records(p, l, &times[i], &chans[i], &flags[i], state);
+                                        unpack_records_scalar(p, l, &times_ref[i], &chans_ref[i], &flags_ref[i], state_ref);
+                                }
+                                records_ok &= times == times_ref && chans == chans_ref && flags == flags_ref
+                                        && state.time_offset == state_ref.time_offset
+                                        && state.rec_idx == state_ref.rec_idx;
+                        }
+                }
+                failed += !report_check(std::string("unpack_raw[") + k.name + "]", raw_ok);
+                failed += !report_check(std::string("unpack_records[") + k.name + "]", records_ok);
+        }
+        return failed;
+}
+
+/*
+ * Parallel binning must give exactly the output of a serial pass. The
+ * first dataset is dense enough that a bin spans several chunks of
+ * parallel_process, as well as narrow bins ending within a chunk. The
+ * second is sparse enough for the timer to wrap several times within
+ * each chunk, so that the wrap offsets which parallel_process sums over
+ * the chunks before them are checked.
+ */
+unsigned int check_parallel_bin(const std::string& dir, const std::string& tools) {
+        struct bin_check {
+                dataset ds;
+                size_t n;
+                std::vector<const char*> widths;
+        };
+        const bin_check checks[] = {
+                { { "check-bin", 2e7, {{ 1, 1, 0, 0 }}, 1e-3 }, 30000000,
+                  { "14000000", "30000", "30000 3000000", "-x 300000" } },
+                { { "check-wrap", 600, {{ 1, 1, 0, 0 }}, 1 }, 12000000,
+                  { "30000000", "-r 3000000", "-x 300000000" } },
+        };
+
+        unsigned int failed = 0;
+        for (const bin_check& c : checks) {
+                std::string path = dir + "/timetag-" + c.ds.name + ".timetag";
+                generate(c.ds, c.n, path);
+                for (const char* w : c.widths) {
+                        std::string args = std::string("timetag_bin -t ") + w;
+                        std::string serial = tool_output(tools, args + " -j1", path);
+                        for (const char* j : { " -j2", " -j4" }) {
+                                bool ok = !serial.empty() && tool_output(tools, args + j, path) == serial;
+                                failed += !report_check(args + j + " (" + c.ds.name + ")", ok);
+                        }
+                }
+                unlink(path.c_str());
+        }
+        return failed;
+}
+
+// The lines of timetag_bin -t output for bins starting at or after t
+std::string bins_from(const std::string& out, uint64_t t) {
+        std::string lines;
+        size_t pos = 0;
+        while (pos < out.size()) {
+                size_t end = out.find('\n', pos);
+                end = end == std::string::npos ? out.size() : end + 1;
+                unsigned long start;
+                if (sscanf(out.c_str() + pos, "%*d %lu", &start) == 1 && start >= t)
+                        lines.append(out, pos, end - pos);
+                pos = end;
+        }
+        return lines;
+}
+
+/*
+ * Binning from a start time, by reading or with an index, must give the
+ * bins of a full run which lie wholly after it. The excitation period is
+ * longer than a bin, so these depend upon the excitation state in effect
+ * at the start time.
+ */
+unsigned int check_start_time(const std::string& dir, const std::string& tools) {
+        const dataset ds = { "check-start", 1e6, {{ 1, 1, 0, 0 }}, 1e-3 };
+        const size_t n = 2000000;
+        const uint64_t width = 10000;
+        std::string path = dir + "/timetag-check-start.timetag";
+        std::string index_path = record_index::path_for(path);
+        generate(ds, n, path);
+        if (system((tools + "/timetag_index --stride 256 " + path).c_str()) != 0)
+                throw std::runtime_error("Error indexing " + path);
+
+        std::string args = "timetag_bin -t -x " + std::to_string(width);
+        std::string full = tool_output(tools, args, path);
+        unsigned int failed = 0;
+        for (uint64_t t : { 12345ULL, 30000017ULL, 45000000ULL, 45005000ULL }) {
+                std::string expected = bins_from(full, (t / width + 1) * width);
+                std::string start = " -s " + std::to_string(t);
+                for (std::string index : { std::string(), " --index " + index_path }) {
+                        std::string out = tool_output(tools, args + start + index, path);
+                        bool ok = !expected.empty() && bins_from(out, (t / width + 1) * width) == expected;
+                        failed += !report_check(args + start + (index.empty() ? "" : " --index"), ok);
+                }
+        }
+        unlink(path.c_str());
+        unlink(index_path.c_str());
+        return failed;
+}
+
+/*
+ * A run of more empty bins than a bin_record can count must still be
+ * given in full, as consecutive runs covering the gap.
+ */
+unsigned int check_zero_runs(const std::string& dir, const std::string& tools) {
+        const uint64_t gap = 1ULL << 33;
+        std::string path = dir + "/timetag-check-runs.timetag";
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+                throw std::runtime_error("Error creating " + path);
+        {
+                record_writer out(fd);
+                out.write(record(CHAN_0_MASK));
+                out.write(record(CHAN_0_MASK | gap));
+                out.flush();
+        }
+        close(fd);
+
+        std::string args = "timetag_bin -t -r 1";
+        std::string out = tool_output(tools, args, path);
+        uint64_t next = 1;
+        bool ok = true;
+        size_t pos = 0;
+        while (pos < out.size()) {
+                size_t end = out.find('\n', pos);
+                end = end == std::string::npos ? out.size() : end + 1;
+                std::string line = out.substr(pos, end - pos);
+                int chan;
+                unsigned long start, count;
+                if (sscanf(line.c_str(), "%d %lu %*u %*u %lu", &chan, &start, &count) == 3 && chan == 0) {
+                        ok &= start == next;
+                        next += count;
+                }
+                pos = end;
+        }
+        unlink(path.c_str());
+        return !report_check(args + " (gap of 2^33 bins)", ok && next == gap);
+}
+
+void run_tool(const dataset& ds, const std::string& tools, const std::string& stage,
+              const std::string& args, const std::string& path, size_t n) {
+        std::string cmd = tools + "/" + args + " < " + path + " > /dev/null";
+        timer t;
+        if (system(cmd.c_str()) != 0)
+                throw std::runtime_error("Error running " + cmd);
+        report(ds, "tool:" + stage, n, t.elapsed());
+}
+
+int main(int argc, char** argv) {
+        size_t n_records = 1 << 22;
+        std::string dir = "/tmp", tools = ".";
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+                ("help,h", "Display help message")
+                ("records,n", po::value<size_t>(&n_records), "records in each dataset")
+                ("dir,d", po::value<std::string>(&dir), "directory to write datasets to")
+                ("tools,t", po::value<std::string>(&tools), "directory containing the tools to run")
+                ("check", "check fast paths against reference implementations instead of timing");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+        }
+
+        if (vm.count("check")) {
+                unsigned int failed = check_unpack_kernels();
+                failed += check_parallel_bin(dir, tools);
+                failed += check_start_time(dir, tools);
+                failed += check_zero_runs(dir, tools);
+                return failed ? 1 : 0;
+        }
+
+        // Stages fold the records they decode into this to keep the work from
+        // being optimised away
+        uint64_t checksum = 0;
+        printf("dataset\tstage\trecords\tbytes\tseconds\trecords_per_s\tbytes_per_s\n");
+        for (const dataset& ds : datasets) {
+                std::string path = dir + "/timetag-bench-" + ds.name + ".timetag";
+                {
+                        timer t;
+                        generate(ds, n_records, path);
+                        report(ds, "generate", n_records, t.elapsed());
+                }
+
+                run_stage(ds, "get_record", path, [&](FILE* in) {
+                        record_stream stream(in);
+                        size_t n = 0;
+                        try {
+                                while (true) {
+                                        checksum += stream.get_record().get_time();
+                                        n++;
+                                }
+                        } catch (end_stream& e) { }
+                        return n;
+                });
+
+                run_stage(ds, "read_records", path, [&](FILE* in) {
+                        record_stream stream(in);
+                        std::vector<record> recs(record_stream::chunk_records);
+                        size_t n = 0, m;
+                        while ((m = stream.read_records(&recs[0], recs.size())) > 0) {
+                                checksum += recs[m-1].get_time();
+                                n += m;
+                        }
+                        return n;
+                });
+
+                run_stage(ds, "parse_records", path, [&](FILE* in) {
+                        record_stream stream(in);
+                        size_t n = 0;
+                        while (n < n_records) {
+                                size_t m = std::min(n_records - n, record_stream::chunk_records);
+                                checksum += stream.parse_records(m).back().time;
+                                n += m;
+                        }
+                        return n;
+                });
+
+                // The binner and writers are fed decoded records so that only they are timed
+                std::vector<record> recs(n_records);
+                {
+                        FILE* in = fopen(path.c_str(), "r");
+                        record_stream stream(in);
+                        size_t n = 0, m;
+                        while ((m = stream.read_records(&recs[n], recs.size() - n)) > 0)
+                                n += m;
+                        fclose(in);
+                }
+
+                {
+                        bin_printer sum_bins = [&](count_t, bin_record b) { checksum += b.count; };
+                        timer t;
+                        multi_binner binner({ 30000 }, sum_bins, WITH_ZEROS);
+                        binner.start(recs[0].get_time());
+                        for (auto r=recs.begin()+1; r != recs.end(); r++)
+                                binner.handle_record(*r);
+                        report(ds, "handle_record", recs.size(), t.elapsed());
+                }
+
+                {
+                        FILE* null = fopen("/dev/null", "w");
+                        timer t;
+                        for (auto r=recs.begin(); r != recs.end(); r++)
+                                write_record(null, *r);
+                        fflush(null);
+                        report(ds, "write_record", recs.size(), t.elapsed());
+                        fclose(null);
+                }
+
+                {
+                        int null = open("/dev/null", O_WRONLY);
+                        timer t;
+                        {
+                                record_writer w(null);
+                                w.write_records(&recs[0], recs.size());
+                        }
+                        report(ds, "record_writer", recs.size(), t.elapsed());
+                        close(null);
+                }
+
+                run_tool(ds, tools, "bin", "timetag_bin -j1 30000", path, n_records);
+                run_tool(ds, tools, "bin-parallel", "timetag_bin 30000", path, n_records);
+                run_tool(ds, tools, "cut", "timetag_cut", path, n_records);
+                run_tool(ds, tools, "cut-strobe", "timetag_cut -s 0", path, n_records);
+                run_tool(ds, tools, "cut-delta", "timetag_cut -d 0", path, n_records);
+                run_tool(ds, tools, "cut-time", "timetag_cut -t 1e6 -T 1e9", path, n_records);
+                run_tool(ds, tools, "cut-filter",
+                         "timetag_cut -f 'strobe(0|1) && delta(0) && time in [1e6,1e9) && !lost'",
+                         path, n_records);
+                run_tool(ds, tools, "cut-tee",
+                         "timetag_cut -f 'strobe(0)' --tee /dev/null='strobe(1)'"
+                         " --tee /dev/null='delta(0)' --tee /dev/null='delta(1)'",
+                         path, n_records);
+
+                unlink(path.c_str());
+        }
+
+        fprintf(stderr, "checksum %lx\n", checksum);
+        return 0;
+}
@@ -22,13 +22,25 @@
 
 
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <functional>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <thread>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #include <boost/program_options.hpp>
 #include "record.h"
+#include "record_index.h"
+#include "record_parallel.h"
+#include "binner.h"
 
 namespace po = boost::program_options;
 
@@ -37,16 +49,28 @@ namespace po = boost::program_options;
  * Temporally bins a photon stream
  *
  * Usage:
- *   bin_photons [--text] [BIN_LENGTH]
+ *   bin_photons [--text] [BIN_LENGTH...]
  *
- * Where BIN_LENGTH is the length of each bin in counter units.
+ * Where BIN_LENGTH is the length of each bin in counter units. Given
+ * several lengths, all are produced from a single pass over the input.
  *
  * Input:
  *   A binary photon stream
  *
  * Output:
  *   A binary stream of bin_records or a textual representation if
- *   --text is given.
+ *   --text is given. With --zero-runs, each run of empty bins is given
+ *   by a single bin_record (see ZERO_RUN). With more than one bin length
+ *   each record is preceded by the length of its bin (see
+ *   tagged_bin_record) and the textual representation gains a leading
+ *   column giving the length.
+ *
+ *   With --by-excitation, photons are counted separately under each
+ *   active delta (excitation) channel; channel 4*DELTA + STROBE counts
+ *   those on strobe channel STROBE while delta channel DELTA is on.
+ *
+ *   With --packed the output is instead a packed bin stream (see
+ *   packed_bin_header), written in blocks.
  *
  * Notes:
  *   We handle wrap-around here by simply keeping all times as 64-bit and
@@ -55,27 +79,46 @@ namespace po = boost::program_options;
  *
  */
 
+struct tagged_bin_record {
+        count_t bin_length;
+        bin_record bin;
+};
+
 /*
- * bin record format
+ * Packed bin stream format
+ *
+ * A packed_bin_header, followed by n_lengths uint64_t bin lengths and
+ * then packed_bin_records, all in native byte order and without padding
+ * such that a reader can map records straight into an array. The
+ * version is increased whenever the layout changes.
  */
-struct bin_record {
-        int chan_n;
-        uint64_t start_time;
-        unsigned int count;
-        unsigned int lost;
+#define PACKED_BIN_MAGIC "TTBN"
+#define PACKED_BIN_VERSION 1
+
+struct __attribute__((packed)) packed_bin_header {
+        char magic[4];
+        uint32_t version;
+        uint64_t clockrate;     // In Hz, or 0 if not known
+        uint32_t n_lengths;
+        uint32_t record_size;
 };
 
-struct input_channel {
-        int chan_n;
-        count_t bin_start;
-        unsigned int count;
-        unsigned int lost;      // IMPORTANT: This is not a count of lost photons, only
-                                //            potential sprees of lost photons
-        input_channel(int chan_n) :
-                chan_n(chan_n), bin_start(0), count(0), lost(0) { }
+#define PACKED_ZERO_RUN 0x1     // count is the number of empty bins from start_time
+
+struct __attribute__((packed)) packed_bin_record {
+        uint64_t start_time;
+        uint32_t count;
+        uint32_t lost;
+        uint8_t chan_n;
+        uint8_t flags;
+        uint16_t length_idx;    // Index of the bin length in the header
 };
 
 void print_text_bin(bin_record b) {
+        if (b.chan_n & ZERO_RUN) {
+                printf("%2d\t%10lu\t%5u\t%5u\t%u\n", b.chan_n & ~ZERO_RUN, b.start_time, 0, 0, b.count);
+                return;
+        }
         printf("%2d\t%10lu\t%5u\t%5u\n", b.chan_n, b.start_time, b.count, b.lost);
 }
 
@@ -84,95 +127,333 @@ void print_bin(bin_record b) {
                 throw new std::runtime_error("failed to write bin");
 }
 
-void handle_record(std::vector<input_channel>& chans, count_t bin_length, record& r,
-                   std::function<void(bin_record)> print, bool with_zeros=true) {
-        std::bitset<4> channels = r.get_channels();
-        uint64_t time = r.get_time();
-        for (auto c=chans.begin(); c != chans.end(); c++) {
-                if (time >= (c->bin_start + bin_length)) {
-                        uint64_t new_bin_start = (time / bin_length) * bin_length;
-                        
-                        // First print photons in last bin
-                        struct bin_record rec = { c->chan_n, c->bin_start, c->count, c->lost };
-                        if (with_zeros || c->count > 0)
-                                print(rec);
-
-                        // Then print zero bins
-                        if (with_zeros) {
-                                for (uint64_t t=c->bin_start+bin_length; t < new_bin_start; t += bin_length) {
-                                        struct bin_record rec = { c->chan_n, t, 0, 0 };
-                                        print(rec);
-                                }
+void print_text_tagged_bin(count_t bin_length, bin_record b) {
+        printf("%10lu\t", bin_length);
+        print_text_bin(b);
+}
+
+void print_tagged_bin(count_t bin_length, bin_record b) {
+        tagged_bin_record r = { bin_length, b };
+        if (write(1, &r, sizeof(tagged_bin_record)) < (int) sizeof(tagged_bin_record))
+                throw new std::runtime_error("failed to write bin");
+}
+
+/*
+ * Writer of a packed bin stream.
+ *
+ * Records are collected in a buffer which is written when full or, for
+ * live use, once its oldest record has waited for the flush latency.
+ */
+class packed_bin_writer {
+        std::vector<count_t> bin_lengths;
+        std::vector<packed_bin_record> buf;
+        size_t buf_len;
+        std::chrono::steady_clock::duration latency;
+        std::chrono::steady_clock::time_point oldest;
+
+        void write_out(const void* data, size_t len) {
+                const char* p = (const char*) data;
+                while (len > 0) {
+                        ssize_t res = ::write(1, p, len);
+                        if (res < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                throw std::runtime_error("failed to write bins");
                         }
+                        p += res;
+                        len -= res;
+                }
+        }
+
+public:
+        packed_bin_writer(std::vector<count_t> lengths, uint64_t clockrate,
+                          size_t buffer_records, double latency_secs)
+                : buf(std::max<size_t>(buffer_records, 1)), buf_len(0),
+                  latency(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(latency_secs)))
+        {
+                std::sort(lengths.begin(), lengths.end());
+                lengths.erase(std::unique(lengths.begin(), lengths.end()), lengths.end());
+                bin_lengths = lengths;
+
+                packed_bin_header h;
+                memcpy(h.magic, PACKED_BIN_MAGIC, 4);
+                h.version = PACKED_BIN_VERSION;
+                h.clockrate = clockrate;
+                h.n_lengths = bin_lengths.size();
+                h.record_size = sizeof(packed_bin_record);
+                write_out(&h, sizeof(h));
+                write_out(&bin_lengths[0], bin_lengths.size() * sizeof(count_t));
+        }
 
-                        // Then start our new bin
-                        c->lost = 0;
-                        c->count = 0;
-                        c->bin_start = new_bin_start;
+        packed_bin_writer(const packed_bin_writer&) = delete;
+        packed_bin_writer& operator=(const packed_bin_writer&) = delete;
+
+        ~packed_bin_writer() {
+                try {
+                        flush();
+                } catch (std::runtime_error& e) {
+                        fprintf(stderr, "Error flushing bins: %s\n", e.what());
                 }
+        }
+
+        void write(count_t bin_length, const bin_record& b) {
+                if (buf_len == 0)
+                        oldest = std::chrono::steady_clock::now();
+
+                packed_bin_record& r = buf[buf_len++];
+                r.start_time = b.start_time;
+                r.count = b.count;
+                r.lost = b.lost;
+                r.chan_n = b.chan_n & ~ZERO_RUN;
+                r.flags = (b.chan_n & ZERO_RUN) ? PACKED_ZERO_RUN : 0;
+                r.length_idx = std::find(bin_lengths.begin(), bin_lengths.end(), bin_length)
+                               - bin_lengths.begin();
 
-                if (r.get_lost_flag())
-                        c->lost++;
-                if (r.get_type() == record::type::STROBE && channels[c->chan_n])
-                        c->count++;
+                if (buf_len == buf.size())
+                        flush();
+        }
+
+        // Milliseconds until the oldest record is due to be flushed, or -1 if none is buffered
+        int ms_until_due() const {
+                if (buf_len == 0)
+                        return -1;
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                oldest + latency - std::chrono::steady_clock::now());
+                return std::max<long>(0, left.count() + 1);
+        }
+
+        // Flush the buffer if its oldest record has waited long enough
+        void poll() {
+                if (buf_len > 0 && std::chrono::steady_clock::now() - oldest >= latency)
+                        flush();
+        }
+
+        void flush() {
+                write_out(&buf[0], buf_len * sizeof(packed_bin_record));
+                buf_len = 0;
+        }
+};
+
+/*
+ * Bin a chunk of a file into out.
+ *
+ * To produce exactly the output of a serial pass, chunks are adjusted to
+ * begin and end at records which close a bin: records at the beginning
+ * of a chunk which fall into the bin of the record preceding it are
+ * left to the previous chunk, which in turn continues past its end
+ * until it sees a record closing its last bin. With several bin lengths
+ * the bins of the longest are used, which requires that it be a multiple
+ * of the others.
+ *
+ * When binning by excitation the delta channel state at the start of the
+ * chunk is that of the last delta record before it. has_deltas saves
+ * searching a file with no delta records.
+ */
+void bin_chunk(const record_file& file, const record_chunk& chunk,
+               const std::vector<count_t>& bin_lengths, zero_bins zeros,
+               bool by_excitation, bool has_deltas, std::vector<tagged_bin_record>& out) {
+        bin_printer print = [&](count_t bin_length, bin_record b) {
+                out.push_back({ bin_length, b });
+        };
+        multi_binner binner(bin_lengths, print, zeros, by_excitation);
+        if (by_excitation && has_deltas) {
+                size_t last_delta = file.find_last_delta(0, chunk.start);
+                if (last_delta != chunk.start)
+                        binner.set_delta_state(file.get_record(last_delta).get_channels());
+        }
+        /*
+         * The range runs to the end of the file as the record closing the
+         * last bin may lie in any later chunk, but the scan stops at it:
+         * no worker reads past the first record at or beyond chunk.end
+         * which closes a bin.
+         */
+        std::vector<record> recs(record_stream::chunk_records);
+        record_range range = file.range(chunk.start, file.size(), chunk.time_offset);
+
+        // The chunk starts in the bin of the preceding record
+        binner.start(file.get_record(chunk.start - 1, chunk.time_offset).get_time());
+        bool started = chunk.index == 0;
+
+        size_t n;
+        while ((n = range.read_records(&recs[0], recs.size())) > 0) {
+                size_t pos = range.tell() - n;
+                for (size_t i=0; i<n; i++) {
+                        const record& r = recs[i];
+                        bool closes = binner.closes(r.get_time());
+                        if (!started) {
+                                // The whole chunk lies within a bin of an earlier chunk
+                                if (pos + i >= chunk.end)
+                                        return;
+                                if (!closes) {
+                                        if (r.get_type() == record::type::DELTA)
+                                                binner.set_delta_state(r.get_channels());
+                                        continue;
+                                }
+                                binner.start(r.get_time());
+                                started = true;
+                        } else if (pos + i >= chunk.end && closes) {
+                                binner.advance(r.get_time());
+                                return;
+                        }
+                        binner.handle_record(r);
+                }
         }
 }
 
 int main(int argc, char** argv) {
-        count_t bin_length = 0;
+        std::vector<count_t> bin_lengths;
 
         po::options_description desc("Allowed options");
         desc.add_options()
                 ("help,h", "Display help message")
-                ("bin-width",  po::value<count_t>(&bin_length)->required(), "The desired bin width")
+                ("bin-width",  po::value<std::vector<count_t>>(&bin_lengths)->required(), "The desired bin widths")
                 ("text,t", "Produce textual representation instead of usual binary output")
-                ("omit-zeros,z", "Omit empty bins");
+                ("omit-zeros,z", "Omit empty bins")
+                ("zero-runs,r", "Give each run of empty bins as a single record")
+                ("by-excitation,x", "Count strobe photons under each active delta channel, as channel 4*DELTA + STROBE")
+                ("packed,P", "Produce a packed bin stream")
+                ("clockrate,c", po::value<uint64_t>(), "clock rate in Hz recorded in a packed bin stream")
+                ("flush-latency,L", po::value<double>(), "longest time in seconds packed bins are held before being written (default 0.1)")
+                ("buffer-bins,B", po::value<size_t>(), "packed bins written at once (default 65536)")
+                ("start-time,s", po::value<count_t>(), "start at timestamp TIME")
+                ("index,i", po::value<std::string>(), "seek to the start time using the given index")
+                ("threads,j", po::value<unsigned int>(), "threads used to bin a file (default: one per CPU)");
 
         po::positional_options_description pd;
-        pd.add("bin-width", 1);
+        pd.add("bin-width", -1);
 
         po::variables_map vm;
         po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
-        po::notify(vm);
 
         if (vm.count("help")) {
                 std::cout << desc << "\n";
                 return 0;
         }
+        po::notify(vm);
+
+        for (auto w=bin_lengths.begin(); w != bin_lengths.end(); w++) {
+                if (*w == 0) {
+                        std::cerr << "Bin width must be positive\n";
+                        return 1;
+                }
+        }
 
         bool text = vm.count("text");
-        bool with_zeros = ! vm.count("omit-zeros");
+        zero_bins zeros = WITH_ZEROS;
+        if (vm.count("omit-zeros"))
+                zeros = OMIT_ZEROS;
+        else if (vm.count("zero-runs"))
+                zeros = ZERO_RUNS;
+        count_t start_time = vm.count("start-time") ? vm["start-time"].as<count_t>() : 0;
 
-        std::vector<input_channel> chans = {
-                { input_channel(0) },
-                { input_channel(1) },
-                { input_channel(2) },
-                { input_channel(3) },
-        };
+        unsigned int n_threads = vm.count("threads") ? vm["threads"].as<unsigned int>()
+                                                     : std::thread::hardware_concurrency();
+
+        // Bins are only tagged with their length when there is more than one
+        bin_printer print;
+        std::unique_ptr<packed_bin_writer> packed;
+        if (vm.count("packed")) {
+                uint64_t clockrate = vm.count("clockrate") ? vm["clockrate"].as<uint64_t>() : 0;
+                double latency = vm.count("flush-latency") ? vm["flush-latency"].as<double>() : 0.1;
+                size_t buffer_bins = vm.count("buffer-bins") ? vm["buffer-bins"].as<size_t>() : 1 << 16;
+                packed.reset(new packed_bin_writer(bin_lengths, clockrate, buffer_bins, latency));
+                packed_bin_writer* w = packed.get();
+                print = [w](count_t bin_length, bin_record b) { w->write(bin_length, b); };
+        } else if (bin_lengths.size() == 1)
+                print = [=](count_t, bin_record b) { text ? print_text_bin(b) : print_bin(b); };
+        else
+                print = text ? print_text_tagged_bin : print_tagged_bin;
+
+        bool by_excitation = vm.count("by-excitation");
+        multi_binner binner(bin_lengths, print, zeros, by_excitation);
         record_stream stream(stdin);
+        std::vector<record> recs(record_stream::chunk_records);
+
+        struct stat st;
+        bool seekable = fstat(fileno(stdin), &st) == 0 && S_ISREG(st.st_mode);
+        if (vm.count("index") && !seekable)
+                std::cerr << "Warning: Input is not seekable, ignoring index\n";
+
+        /*
+         * A file can be binned in parallel. Each chunk's bins are buffered
+         * and printed in order.
+         */
+        if (n_threads > 1 && start_time == 0 && !stream.is_packed() && binner.nested() && seekable) {
+                record_file file(fileno(stdin));
+                if (file.size() < 2)
+                        return 0;
+                bool has_deltas = by_excitation && file.find_last_delta(0, file.size()) != file.size();
+
+                std::vector<std::vector<tagged_bin_record>> outputs(n_threads);
+                auto process = [&](unsigned int slot, const record_chunk& chunk) {
+                        bin_chunk(file, chunk, bin_lengths, zeros, by_excitation, has_deltas, outputs[slot]);
+                };
+                auto merge = [&](unsigned int slot, const record_chunk& chunk) {
+                        for (auto b=outputs[slot].begin(); b != outputs[slot].end(); b++)
+                                print(b->bin_length, b->bin);
+                        outputs[slot].clear();
+                        if (packed)
+                                packed->poll();
+                };
+
+                // We throw away the first photon to get the bin start times
+                parallel_process(file, 1, 0, n_threads, process, merge);
+                return 0;
+        }
+
+        // The excitation state at the start time is that of the last delta record before it
+        if (vm.count("index") && seekable && start_time > 0) {
+                record_index index(vm["index"].as<std::string>().c_str());
+                const index_entry* e = seek_time(stream, index, start_time);
+                if (e && e->delta_idx != ~0ULL)
+                        binner.set_delta_state(e->delta_state);
+        }
         
         // Disable write buffering
         setvbuf(stdout, NULL, _IONBF, 0);
-        setvbuf(stdin, NULL, _IOFBF, sizeof(record)*30);
 
         /*
-         * We throw away the first photon to get the bin start times.
+         * Skip records before the start time. We throw away the first
+         * photon after that to get the bin start times.
          */
-        {
-                record r = stream.get_record();
-                uint64_t time = r.get_time();
-                for (auto c=chans.begin(); c != chans.end(); c++)
-                        c->bin_start = (time / bin_length) * bin_length;
-        }
+        size_t n, first;
+        do {
+                n = stream.read_records(&recs[0], recs.size());
+                if (n == 0)
+                        return 0;
+                for (first = 0; first < n && recs[first].get_time() < start_time; first++) {
+                        if (recs[first].get_type() == record::type::DELTA)
+                                binner.set_delta_state(recs[first].get_channels());
+                }
+        } while (first == n);
 
-        std::function<void(struct bin_record)> print = text ? print_text_bin : print_bin;
-        while (true) {
-                try {
-                record r = stream.get_record();
-                        handle_record(chans, bin_length, r, print, with_zeros);
-                } catch (end_stream e) { break; }
+        /*
+         * A live stream may go quiet with bins still buffered. Rather than
+         * block in a read, wait for input only until the oldest of them is
+         * due and flush them if none arrives.
+         */
+        auto read_batch = [&]() {
+                if (packed && !stream.has_buffered()) {
+                        int timeout = packed->ms_until_due();
+                        struct pollfd pfd = { fileno(stdin), POLLIN, 0 };
+                        if (timeout >= 0 && poll(&pfd, 1, timeout) == 0)
+                                packed->flush();
+                }
+                return stream.read_records(&recs[0], recs.size());
+        };
+
+        binner.start(recs[first].get_time());
+        if (recs[first].get_type() == record::type::DELTA)
+                binner.set_delta_state(recs[first].get_channels());
+        for (size_t i=first+1; i<n; i++)
+                binner.handle_record(recs[i]);
+        while ((n = read_batch()) > 0) {
+                for (size_t i=0; i<n; i++)
+                        binner.handle_record(recs[i]);
+                if (packed)
+                        packed->poll();
         }
 
         return 0;
 }
-
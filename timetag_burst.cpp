@@ -0,0 +1,261 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include "record.h"
+
+namespace po = boost::program_options;
+
+/*
+ *
+ * Searches a photon stream for single-molecule bursts
+ *
+ * Usage:
+ *   timetag_burst [--text] --window-time T [--window-photons M]
+ *                 [--min-photons L] [input-file]
+ *
+ *   A photon belongs to a burst if it lies in a window of M consecutive
+ *   photons spanning no more than T counter units (the all-photon burst
+ *   search). Bursts of fewer than L photons are dropped. Only photons on
+ *   the donor and acceptor channels are considered.
+ *
+ *   Each photon is assigned to donor or acceptor excitation by the state
+ *   of the delta channels in effect when it arrived, as in timetag_cut.
+ *   Without delta records all photons are taken to be excited by the
+ *   donor laser.
+ *
+ * Output:
+ *   A binary stream of burst_records or a textual representation if
+ *   --text is given.
+ *
+ */
+
+/*
+ * burst record format
+ *
+ * Photon streams are named by excitation then emission, e.g. da counts
+ * acceptor photons under donor excitation. efficiency and stoichiometry
+ * are the uncorrected
+ *
+ *   E = da / (da + dd)
+ *   S = (dd + da) / (dd + da + aa)
+ *
+ * and are NaN when undefined.
+ */
+struct burst_record {
+        uint64_t start_time, end_time;
+        uint32_t counts[4];     // Photons on each strobe channel
+        uint32_t dd, da, ad, aa;
+        float efficiency, stoichiometry;
+};
+
+struct burst_photon {
+        uint64_t time;
+        uint8_t channels;
+        bool acceptor_excitation;
+};
+
+struct burst_params {
+        count_t window_time;
+        unsigned int window_photons, min_photons;
+        unsigned int donor, acceptor;                   // Strobe channels
+        unsigned int donor_exc, acceptor_exc;           // Delta channels
+};
+
+void print_text_burst(const burst_record& b) {
+        printf("%10lu\t%10lu\t%5u\t%5u\t%5u\t%5u\t%5u\t%5u\t%5u\t%5u\t%6.3f\t%6.3f\n",
+               b.start_time, b.end_time, b.counts[0], b.counts[1], b.counts[2], b.counts[3],
+               b.dd, b.da, b.ad, b.aa, b.efficiency, b.stoichiometry);
+}
+
+void print_burst(const burst_record& b) {
+        if (fwrite(&b, sizeof(burst_record), 1, stdout) != 1)
+                throw std::runtime_error("failed to write burst");
+}
+
+/*
+ * Streaming all-photon burst search.
+ *
+ * The last M photons are kept in a ring. Whenever the window ending at
+ * photon n is short enough its photons join the current burst. Windows
+ * ending at e1 < e2 overlap or abut when e2 - e1 <= M, so a burst ends
+ * once M photons have passed without a qualifying window.
+ */
+class burst_search {
+        burst_params params;
+        std::vector<burst_photon> ring;
+        uint64_t n;                     // Photons seen
+        bool active;
+        uint64_t last_end;              // Last photon of the current burst
+        uint32_t n_photons;             // Photons in the current burst
+        burst_record burst;
+        std::bitset<4> delta_state;
+        bool seen_delta;
+        void (*print)(const burst_record&);
+
+        const burst_photon& photon(uint64_t i) const { return ring[i % ring.size()]; }
+
+        void add_photon(const burst_photon& p) {
+                if (n_photons == 0)
+                        burst.start_time = p.time;
+                burst.end_time = p.time;
+                n_photons++;
+
+                std::bitset<4> channels(p.channels);
+                for (int c=0; c<4; c++)
+                        burst.counts[c] += channels[c];
+
+                bool d = channels[params.donor], a = channels[params.acceptor];
+                if (p.acceptor_excitation) {
+                        burst.ad += d;
+                        burst.aa += a;
+                } else {
+                        burst.dd += d;
+                        burst.da += a;
+                }
+        }
+
+        void finish_burst() {
+                active = false;
+                if (n_photons >= params.min_photons) {
+                        double dd = burst.dd, da = burst.da, aa = burst.aa;
+                        burst.efficiency = (da + dd) > 0 ? da / (da + dd) : NAN;
+                        burst.stoichiometry = (dd + da + aa) > 0 ? (dd + da) / (dd + da + aa) : NAN;
+                        print(burst);
+                }
+        }
+
+        void start_burst() {
+                active = true;
+                n_photons = 0;
+                burst = burst_record();
+        }
+
+public:
+        burst_search(const burst_params& params, void (*print)(const burst_record&))
+                : params(params), ring(params.window_photons), n(0), active(false),
+                  last_end(0), n_photons(0), burst(), seen_delta(false), print(print) { }
+
+        void handle_record(const record& r) {
+                std::bitset<4> channels = r.get_channels();
+                if (r.get_type() == record::type::DELTA) {
+                        delta_state = channels;
+                        seen_delta = true;
+                        return;
+                }
+                if (!channels[params.donor] && !channels[params.acceptor])
+                        return;
+
+                const uint64_t m = params.window_photons;
+                burst_photon& p = ring[n % m];
+                p.time = r.get_time();
+                p.channels = channels.to_ulong();
+                p.acceptor_excitation = seen_delta && !delta_state[params.donor_exc]
+                                        && delta_state[params.acceptor_exc];
+
+                if (n + 1 >= m && p.time - photon(n + 1 - m).time <= params.window_time) {
+                        uint64_t first = n + 1 - m;
+                        if (active && n - last_end <= m) {
+                                first = last_end + 1;
+                        } else {
+                                if (active)
+                                        finish_burst();
+                                start_burst();
+                        }
+                        for (uint64_t i=first; i<=n; i++)
+                                add_photon(photon(i));
+                        last_end = n;
+                } else if (active && n - last_end >= m) {
+                        finish_burst();
+                }
+                n++;
+        }
+
+        void finish() {
+                if (active)
+                        finish_burst();
+        }
+};
+
+int main(int argc, char** argv) {
+        burst_params params = { 0, 10, 30, 0, 1, 0, 1 };
+        std::string input;
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+                ("help,h", "Display help message")
+                ("text,t", "Produce textual representation instead of usual binary output")
+                ("window-time,T", po::value<count_t>(&params.window_time)->required(), "maximum length of a window in counter units")
+                ("window-photons,m", po::value<unsigned int>(&params.window_photons), "photons in a window")
+                ("min-photons,L", po::value<unsigned int>(&params.min_photons), "minimum photons in a burst")
+                ("donor,d", po::value<unsigned int>(&params.donor), "donor emission strobe channel")
+                ("acceptor,a", po::value<unsigned int>(&params.acceptor), "acceptor emission strobe channel")
+                ("donor-excitation,D", po::value<unsigned int>(&params.donor_exc), "donor excitation delta channel")
+                ("acceptor-excitation,A", po::value<unsigned int>(&params.acceptor_exc), "acceptor excitation delta channel")
+                ("input", po::value<std::string>(&input), "record file to read instead of stdin");
+
+        po::positional_options_description pd;
+        pd.add("input", 1);
+
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
+
+        if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+        }
+        po::notify(vm);
+
+        if (params.window_photons < 2 || params.donor > 3 || params.acceptor > 3
+            || params.donor_exc > 3 || params.acceptor_exc > 3) {
+                std::cerr << "Windows must hold at least two photons and channels be in 0-3\n";
+                return 1;
+        }
+
+        FILE* in = stdin;
+        if (!input.empty() && (in = fopen(input.c_str(), "r")) == NULL) {
+                std::cerr << "Error opening " << input << "\n";
+                return 1;
+        }
+
+        burst_search search(params, vm.count("text") ? print_text_burst : print_burst);
+        record_stream stream(in);
+        std::vector<record> recs(record_stream::chunk_records);
+        size_t n;
+        while ((n = stream.read_records(&recs[0], recs.size())) > 0) {
+                for (size_t i=0; i<n; i++)
+                        search.handle_record(recs[i]);
+                // Bursts are few; don't hold them back from a live reader
+                fflush(stdout);
+        }
+        search.finish();
+        return 0;
+}
@@ -0,0 +1,279 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include "record.h"
+
+namespace po = boost::program_options;
+
+/*
+ *
+ * Computes auto- and cross-correlations of a photon stream
+ *
+ * Usage:
+ *   timetag_corr [--pair I,J ...] [--resolution TICKS] [--levels N]
+ *                [--lags P] [--snapshot-interval TIME] [input-file]
+ *
+ *   Correlates strobe channel I with strobe channel J, by default giving
+ *   the autocorrelation of each channel. Records are read from the given
+ *   file or from stdin.
+ *
+ * Output:
+ *   A table of normalized correlations, one line per pair and lag,
+ *
+ *     I  J  LAG  G(LAG)
+ *
+ *   where LAG is in counter units. The table is written at the end of
+ *   the input and, given --snapshot-interval, each time that much time
+ *   has passed in the input. Tables are terminated by a blank line.
+ *
+ * Notes:
+ *   We use the multi-tau scheme: the photon counts are binned at the
+ *   resolution and correlated at P lags. Each further level halves the
+ *   resolution, correlating its bins at lags P/2 to P-1 of its own bin
+ *   width. Memory is therefore O(P log(max lag)) regardless of the length
+ *   of the input. Each level stores its last P bins in a ring indexed by
+ *   bin number, so runs of empty bins are skipped in O(P) time and only
+ *   bins holding photons cost anything to correlate.
+ *
+ *   With N bins of a level spanning the data and n_i photons on channel
+ *   i, the correlation of bins k apart is normalized as
+ *
+ *     G(k) = S(k) N^2 / ((N - k) n_i n_j)
+ *
+ *   where S(k) is the sum of products of the counts, such that
+ *   uncorrelated photons give G = 1.
+ *
+ */
+
+typedef std::array<uint32_t, 4> bin_counts;
+
+struct channel_pair {
+        unsigned int i, j;
+};
+
+class multi_tau {
+        struct level {
+                uint64_t cur;                   // Index of the current bin
+                std::vector<bin_counts> bins;   // Bin n is at n % n_lags
+                std::vector<std::vector<double>> sums; // Of each pair at each lag
+        };
+
+        std::vector<channel_pair> pairs;
+        count_t resolution;
+        unsigned int n_lags;
+        std::vector<level> levels;
+        bool started;
+        uint64_t start_time, last_time;
+        std::array<uint64_t, 4> photons;
+
+        unsigned int min_lag(unsigned int l) const { return l == 0 ? 1 : n_lags / 2; }
+
+        bool empty(const bin_counts& b) const {
+                return (b[0] | b[1] | b[2] | b[3]) == 0;
+        }
+
+        // Correlate the (complete) current bin of level l with those before it
+        void correlate(level& lv, unsigned int l) {
+                const bin_counts& b = lv.bins[lv.cur % n_lags];
+                unsigned int max_k = std::min<uint64_t>(n_lags - 1, lv.cur);
+                for (size_t p=0; p<pairs.size(); p++) {
+                        uint32_t bj = b[pairs[p].j];
+                        if (bj == 0)
+                                continue;
+                        std::vector<double>& sums = lv.sums[p];
+                        for (unsigned int k=min_lag(l); k <= max_k; k++)
+                                sums[k] += (double) bj * lv.bins[(lv.cur - k) % n_lags][pairs[p].i];
+                }
+        }
+
+        // Add counts to bin n of level l
+        void add(unsigned int l, uint64_t n, const bin_counts& counts) {
+                level& lv = levels[l];
+                if (n != lv.cur) {
+                        bin_counts& last = lv.bins[lv.cur % n_lags];
+                        if (!empty(last)) {
+                                correlate(lv, l);
+                                if (l+1 < levels.size())
+                                        add(l+1, lv.cur / 2, last);
+                        }
+
+                        // Clear the bins skipped over, oldest to newest
+                        uint64_t gap = std::min<uint64_t>(n - lv.cur, n_lags);
+                        for (uint64_t m = n - gap + 1; m <= n; m++)
+                                lv.bins[m % n_lags] = bin_counts();
+                        lv.cur = n;
+                }
+
+                bin_counts& b = lv.bins[n % n_lags];
+                for (int c=0; c<4; c++)
+                        b[c] += counts[c];
+        }
+
+public:
+        multi_tau(const std::vector<channel_pair>& pairs, count_t resolution,
+                  unsigned int n_levels, unsigned int n_lags)
+                : pairs(pairs), resolution(resolution), n_lags(n_lags),
+                  levels(n_levels), started(false), start_time(0), last_time(0), photons()
+        {
+                for (auto lv=levels.begin(); lv != levels.end(); lv++) {
+                        lv->cur = 0;
+                        lv->bins.resize(n_lags);
+                        lv->sums.assign(pairs.size(), std::vector<double>(n_lags, 0));
+                }
+        }
+
+        void handle_record(const record& r) {
+                if (r.get_type() != record::type::STROBE)
+                        return;
+                std::bitset<4> channels = r.get_channels();
+                if (channels.none())
+                        return;
+
+                uint64_t time = r.get_time();
+                if (!started) {
+                        // Bins are numbered from the first photon
+                        start_time = time;
+                        started = true;
+                }
+                last_time = time;
+
+                bin_counts counts = bin_counts();
+                for (int c=0; c<4; c++) {
+                        if (channels[c]) {
+                                counts[c] = 1;
+                                photons[c]++;
+                        }
+                }
+                add(0, (time - start_time) / resolution, counts);
+        }
+
+        uint64_t elapsed() const { return started ? last_time - start_time : 0; }
+
+        /*
+         * Print the correlations of the data seen so far. Bins which
+         * are still open are not included.
+         */
+        void print() const {
+                uint64_t duration = elapsed();
+                for (size_t p=0; p<pairs.size(); p++) {
+                        double ni = photons[pairs[p].i], nj = photons[pairs[p].j];
+                        if (ni == 0 || nj == 0)
+                                continue;
+                        for (unsigned int l=0; l<levels.size(); l++) {
+                                count_t width = resolution << l;
+                                double n_bins = duration / width;
+                                for (unsigned int k=min_lag(l); k<n_lags; k++) {
+                                        if (n_bins <= k)
+                                                break;
+                                        double g = levels[l].sums[p][k] * n_bins * n_bins
+                                                / ((n_bins - k) * ni * nj);
+                                        printf("%u\t%u\t%lu\t%g\n", pairs[p].i, pairs[p].j,
+                                               (unsigned long) (k * width), g);
+                                }
+                        }
+                }
+                printf("\n");
+                fflush(stdout);
+        }
+};
+
+int main(int argc, char** argv) {
+        count_t resolution = 1, interval = 0;
+        unsigned int n_levels = 24, n_lags = 16;
+        std::vector<std::string> pair_args;
+        std::string input;
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+                ("help,h", "Display help message")
+                ("pair,p", po::value<std::vector<std::string>>(&pair_args), "correlate channels I,J (may be repeated)")
+                ("resolution,r", po::value<count_t>(&resolution), "width of the shortest bins in counter units")
+                ("levels,l", po::value<unsigned int>(&n_levels), "number of levels, each doubling the bin width")
+                ("lags,P", po::value<unsigned int>(&n_lags), "lags per level")
+                ("snapshot-interval,u", po::value<count_t>(&interval), "print correlations every TIME counter units")
+                ("input", po::value<std::string>(&input), "record file to read instead of stdin");
+
+        po::positional_options_description pd;
+        pd.add("input", 1);
+
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+        }
+
+        if (resolution == 0 || n_levels == 0 || n_lags < 2 || n_lags % 2) {
+                std::cerr << "Resolution and levels must be positive and lags even\n";
+                return 1;
+        }
+
+        std::vector<channel_pair> pairs;
+        for (auto a=pair_args.begin(); a != pair_args.end(); a++) {
+                unsigned int i, j;
+                if (sscanf(a->c_str(), "%u,%u", &i, &j) != 2 || i > 3 || j > 3) {
+                        std::cerr << "Invalid channel pair " << *a << "\n";
+                        return 1;
+                }
+                pairs.push_back({ i, j });
+        }
+        if (pairs.empty()) {
+                for (unsigned int c=0; c<4; c++)
+                        pairs.push_back({ c, c });
+        }
+
+        FILE* in = stdin;
+        if (!input.empty() && (in = fopen(input.c_str(), "r")) == NULL) {
+                std::cerr << "Error opening " << input << "\n";
+                return 1;
+        }
+
+        multi_tau corr(pairs, resolution, n_levels, n_lags);
+        record_stream stream(in);
+        std::vector<record> recs(record_stream::chunk_records);
+        uint64_t next_snapshot = interval;
+        size_t n;
+        while ((n = stream.read_records(&recs[0], recs.size())) > 0) {
+                for (size_t i=0; i<n; i++) {
+                        corr.handle_record(recs[i]);
+                        if (interval && corr.elapsed() >= next_snapshot) {
+                                corr.print();
+                                next_snapshot += interval;
+                        }
+                }
+        }
+
+        corr.print();
+        return 0;
+}
@@ -23,31 +23,102 @@
 
 #include <vector>
 #include <iostream>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <boost/program_options.hpp>
 #include "record.h"
+#include "record_index.h"
+#include "record_filter.h"
+#include "record_unpack.h"
 
 namespace po = boost::program_options;
 
+/*
+ * Extracts subsets of a record stream.
+ *
+ * Usage:
+ *   timetag_cut [options] [--filter EXPR] [--tee FILE=EXPR ...]
+ *
+ * Records matching the filter (see record_filter.h), which is the
+ * conjunction of EXPR with the --strobe-on, --delta-on, --start-time and
+ * --end-time options, are written to stdout. Each --tee writes the
+ * records matching its own expression to FILE from the same pass, e.g.
+ *
+ *   timetag_cut -f 'delta(0)' --tee dd.timetag='strobe(0) && delta(0)' \
+ *                             --tee da.timetag='strobe(1) && delta(0)'
+ *
+ * The record range options apply to all outputs. Delta records are never
+ * written. With --preserve-wraps, wrap records within the record range
+ * are always written, as strobe records with no channels.
+ */
+
+// A destination for the records matching a filter
+struct output {
+        record_filter filter;
+        std::shared_ptr<record_writer> writer;
+        int fd;
+
+        output(const std::string& expr, int fd)
+                : filter(expr), writer(std::make_shared<record_writer>(fd)), fd(fd) { }
+};
+
+/*
+ * Write the packed wrap record p as a strobe record with no channels.
+ * The wrap may be carried by a delta record, which mustn't be written as
+ * a change of excitation state.
+ */
+static void write_wrap(record_writer& out, const uint8_t* p) {
+        uint8_t wrap[RECORD_LENGTH];
+        memcpy(wrap, p, RECORD_LENGTH);
+        wrap[0] &= ~(REC_TYPE_MASK >> 40);
+        wrap[1] &= ~(CHANNEL_MASK >> 32);
+        out.write_raw(wrap, 1);
+}
+
+/*
+ * Write records [first, last) of the block in raw flagged in keep, in
+ * runs of their packed form.
+ */
+static void write_kept(record_writer& out, const uint8_t* raw, const uint8_t* keep,
+                       const uint8_t* flags, size_t first, size_t last, bool preserve_wraps) {
+        size_t j = first;
+        while (j < last) {
+                size_t run = j;
+                while (j < last && keep[j])
+                        j++;
+                out.write_raw(raw + run*RECORD_LENGTH, j - run);
+
+                for (; j < last && !keep[j]; j++) {
+                        if (preserve_wraps && (flags[j] & UNPACK_FLAG_WRAP))
+                                write_wrap(out, raw + j*RECORD_LENGTH);
+                }
+        }
+}
+
 int main(int argc, char** argv) {
         po::options_description desc("Allowed options");
         desc.add_options()
                 ("help,h", "Display help message")
+                ("filter,f", po::value<std::string>(), "include only records matching EXPR")
+                ("tee", po::value<std::vector<std::string>>(), "also write records matching EXPR to FILE, given as FILE=EXPR")
                 ("strobe-on,s", po::value<unsigned int>(), "include only records with strobe channel N active")
                 ("delta-on,d", po::value<unsigned int>(), "include only records with delta channel N active")
-                ("start-time,t", po::value<float>(), "start at timestamp TIME")
-                ("end-time,T", po::value<float>(), "end at timestamp TIME")
+                ("start-time,t", po::value<std::string>(), "start at timestamp TIME")
+                ("end-time,T", po::value<std::string>(), "end at timestamp TIME")
                 ("skip-records,r", po::value<unsigned int>(), "skip N records")
                 ("truncate-records,R", po::value<unsigned int>(), "truncate all records past N")
                 ("drop-initial-wraps,W", po::value<unsigned int>(), "ignore data until the Nth wrap-around")
-                ("preserve-wraps,w", po::value<bool>(), "Keep wrap records");
+                ("preserve-wraps,w", po::value<bool>(), "Keep wrap records")
+                ("index,i", po::value<std::string>(), "seek using the given index (see timetag_index)");
 
         po::variables_map vm;
         po::store(po::parse_command_line(argc, argv, desc), vm);
         po::notify(vm);
 
-        int strobe_on = -1, delta_on = -1;
-        std::bitset<4> delta_status;
-        uint64_t start_time = 0,  end_time = 1ULL << 63;
+        uint8_t delta_state = 0;
+        uint64_t start_time = 0,  end_time = UINT64_MAX;
         unsigned int skip_records = 0, truncate_records = 0;
         unsigned int drop_wraps = 0;
         bool preserve_wraps = false;
@@ -57,17 +128,26 @@ int main(int argc, char** argv) {
                 return 0;
         }
 
+        // The filter for stdout is built up from the individual options
+        std::vector<std::string> terms;
+        if (vm.count("filter"))
+                terms.push_back("(" + vm["filter"].as<std::string>() + ")");
+
         if (vm.count("strobe-on"))
-                strobe_on = vm["strobe-on"].as<unsigned int>();
+                terms.push_back("strobe(" + std::to_string(vm["strobe-on"].as<unsigned int>()) + ")");
 
         if (vm.count("delta-on"))
-                delta_on = vm["delta-on"].as<unsigned int>();
+                terms.push_back("delta(" + std::to_string(vm["delta-on"].as<unsigned int>()) + ")");
 
         if (vm.count("start-time"))
-                start_time = round(vm["start-time"].as<float>());
+                start_time = parse_time(vm["start-time"].as<std::string>());
 
         if (vm.count("end-time"))
-                end_time = round(vm["end-time"].as<float>());
+                end_time = parse_time(vm["end-time"].as<std::string>());
+
+        if (vm.count("start-time") || vm.count("end-time"))
+                terms.push_back("time in [" + std::to_string(start_time) + ","
+                                + std::to_string(end_time) + "]");
 
         if (vm.count("skip-records"))
                 skip_records = vm["skip-records"].as<unsigned int>();
@@ -81,39 +161,134 @@ int main(int argc, char** argv) {
         if (vm.count("preserve-wraps"))
                 preserve_wraps = true;
 
-        record_stream stream(stdin, drop_wraps);
-        unsigned int i=0;
-        while (true) {
-                try {
-                        bool drop = false;
-                        record r = stream.get_record();
-                        i++;
-
-                        if (r.get_type() == record::DELTA) {
-                                delta_status = r.get_channels();
-                                continue;
-                        }
+        std::string expr = "true";
+        for (size_t k=0; k<terms.size(); k++)
+                expr = k ? expr + " && " + terms[k] : terms[k];
 
-                        // Temporal filters
-                        if (r.get_time() > end_time) drop = true;
-                        if (r.get_time() < start_time) drop = true;
-                        if (i <= skip_records) drop = true;
-                        if (truncate_records != 0 && i >= truncate_records) drop = true;
-
-                        // Always keep wrap records but drop set channels
-                        if (!drop && r.get_wrap_flag() && preserve_wraps) {
-                                r.data &= ~CHANNEL_MASK;
-                                write_record(stdout, r);
-                        } else if (drop) {
-                                continue;
-                        } else {
-                                // Channel filters
-                                std::bitset<4> chans = r.get_channels();
-                                if (strobe_on != -1 && !chans[strobe_on]) continue;
-                                if (delta_on != -1 && !delta_status[delta_on]) continue;
-
-                                write_record(stdout, r);
+        std::vector<output> outputs;
+        try {
+                outputs.emplace_back(expr, fileno(stdout));
+                if (vm.count("tee")) {
+                        for (const std::string& t : vm["tee"].as<std::vector<std::string>>()) {
+                                size_t eq = t.find('=');
+                                if (eq == std::string::npos)
+                                        throw std::runtime_error("Expected FILE=EXPR in --tee " + t);
+                                std::string path = t.substr(0, eq);
+                                int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                                if (fd < 0)
+                                        throw std::runtime_error("Error opening " + path);
+                                outputs.emplace_back(t.substr(eq+1), fd);
                         }
-                } catch (end_stream e) { break; }
+                }
+        } catch (std::runtime_error& e) {
+                std::cerr << e.what() << "\n";
+                return 1;
+        }
+
+        bool uses_deltas = false;
+        for (const output& o : outputs)
+                uses_deltas |= o.filter.uses_deltas();
+
+        struct stat st;
+        bool seekable = fstat(fileno(stdin), &st) == 0 && S_ISREG(st.st_mode);
+        std::shared_ptr<record_index> index;
+        if (vm.count("index")) {
+                if (seekable)
+                        index = std::make_shared<record_index>(vm["index"].as<std::string>().c_str());
+                else
+                        std::cerr << "Warning: Input is not seekable, ignoring index\n";
+        }
+
+        record_stream stream(stdin, index ? 0 : drop_wraps);
+
+        /*
+         * With an index we can find the wrap and time we are asked to
+         * start at without reading the preceding records. The output
+         * must be byte for byte that of reading every record. Records
+         * before the start time may only be skipped if no tee wants
+         * them, and with --preserve-wraps the wraps among them are
+         * written from the mapped file, which we can't do for a packed
+         * stream.
+         */
+        uint64_t dropped = 0;
+        if (index)
+                dropped = seek_wraps(stream, *index, drop_wraps);
+        uint64_t base = stream.tell();
+
+        if (index && vm.count("start-time") && outputs.size() == 1
+            && !(preserve_wraps && stream.is_packed())) {
+                const index_entry* e = seek_time(stream, *index, start_time, dropped);
+                if (e && e->delta_idx != ~0ULL && e->delta_idx >= base)
+                        delta_state = e->delta_state;
+
+                if (e && preserve_wraps) {
+                        record_file file(fileno(stdin));
+                        size_t end = stream.tell();
+                        if (truncate_records != 0)
+                                end = std::min<size_t>(end, base + truncate_records - 1);
+                        for (size_t j = base + skip_records; j < end; j++)
+                                if (file.get_raw(j) & TIMER_WRAP_MASK)
+                                        write_wrap(*outputs[0].writer, file.raw(j));
+                }
+        }
+        uint64_t i = stream.tell() - base;
+
+        /*
+         * When reading from a file we can jump over skipped records
+         * instead of decoding them. We need only look at them for the
+         * wrap offset and the delta channel state if a filter depends
+         * upon these.
+         */
+        if (i < skip_records && seekable && !stream.is_packed()) {
+                record_file file(fileno(stdin));
+                size_t start = stream.tell();
+                size_t end = std::min<size_t>(base + skip_records, file.size());
+                uint64_t time_offset = stream.get_time_offset()
+                        + file.count_wraps(start, end) * ((1ULL<<TIME_BITS) - 1);
+
+                if (uses_deltas) {
+                        size_t last_delta = file.find_last_delta(start, end);
+                        if (last_delta != end)
+                                delta_state = file.get_record(last_delta).get_channels().to_ulong();
+                }
+
+                stream.seek(end, time_offset);
+                i = end - base;
+        }
+
+        const size_t chunk = record_stream::chunk_records;
+        std::vector<uint64_t> times(chunk);
+        std::vector<uint8_t> channels(chunk), flags(chunk), deltas(chunk), keep(chunk);
+        // Records the filters never pass on
+        const uint8_t never = UNPACK_FLAG_DELTA | (preserve_wraps ? UNPACK_FLAG_WRAP : 0);
+
+        size_t n;
+        while ((n = stream.read_columns(&times[0], &channels[0], &flags[0], chunk)) > 0) {
+                const uint8_t* raw = stream.raw_records();
+                if (uses_deltas)
+                        track_deltas(&channels[0], &flags[0], n, &deltas[0], delta_state);
+                filter_block b = { n, &times[0], &channels[0], &flags[0], &deltas[0] };
+
+                // The block's records are numbered i+1 through i+n
+                size_t first = std::min<uint64_t>(n, skip_records > i ? skip_records - i : 0);
+                size_t last = n;
+                if (truncate_records != 0)
+                        last = std::min<uint64_t>(n, truncate_records > i+1 ? truncate_records - i - 1 : 0);
+                i += n;
+                if (first >= last)
+                        continue;
+
+                for (output& o : outputs) {
+                        o.filter.eval(b, &keep[0]);
+                        for (size_t j=first; j<last; j++)
+                                keep[j] &= (flags[j] & never) == 0;
+                        write_kept(*o.writer, raw, &keep[0], &flags[0], first, last, preserve_wraps);
+                }
+        }
+
+        for (output& o : outputs) {
+                o.writer->flush();
+                if (o.fd != fileno(stdout))
+                        close(o.fd);
         }
 }
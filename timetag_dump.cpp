@@ -23,14 +23,22 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <memory>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "record.h"
+#include "record_index.h"
 
 /*
  *
  * Decodes a binary photon stream to human readable format.
  * Usage:
- *   dump_records
+ *   dump_records [-i INDEX] [-w WRAPS] [-t TIME]
+ *
+ *   -w WRAPS    Start after the given number of wrap-arounds
+ *   -t TIME     Start at the given timestamp
+ *   -i INDEX    Seek to the above using the given index
  *
  * Input:
  *   A binary photon stream
@@ -41,7 +49,7 @@
  * Where A, B, C, D are flag statuses
  */
 
-void dump_record(record& r, int count) { 
+void dump_record(const record& r, int count) { 
 	uint64_t time = r.get_raw_time();
 	std::bitset<4> channels = r.get_channels();
 	printf("%u\t%11llu\t%s\t%s\t%s\t%d\t%d\t%d\t%d\n",
@@ -57,16 +65,57 @@ void dump_record(record& r, int count) {
 }
 
 int main(int argc, char** argv) {
-	unsigned int count = 0;
-        record_stream stream(stdin);
+	std::shared_ptr<record_index> index;
+	unsigned int drop_wraps = 0;
+	uint64_t start_time = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:w:t:")) != -1) {
+		switch (c) {
+		case 'i':
+			index = std::make_shared<record_index>(optarg);
+			break;
+		case 'w':
+			drop_wraps = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			start_time = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-i INDEX] [-w WRAPS] [-t TIME]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	struct stat st;
+	if (index && !(fstat(fileno(stdin), &st) == 0 && S_ISREG(st.st_mode))) {
+		fprintf(stderr, "Warning: Input is not seekable, ignoring index\n");
+		index.reset();
+	}
+
+	record_stream stream(stdin, index ? 0 : drop_wraps);
+	uint64_t dropped = 0;
+	if (index) {
+		dropped = seek_wraps(stream, *index, drop_wraps);
+		if (start_time > 0)
+			seek_time(stream, *index, start_time, dropped);
+	}
+
+	unsigned int count = stream.tell();
+	std::vector<record> recs(record_stream::chunk_records);
+	size_t n;
 
 	setvbuf(stdout, NULL, _IONBF, 0);
-	while (true) {
-		try {
-			record r = stream.get_record();
-			dump_record(r, count);
+	while ((n = stream.read_records(&recs[0], recs.size())) > 0) {
+		for (size_t i=0; i<n; i++) {
+			if (recs[i].get_time() < start_time) {
+				count++;
+				continue;
+			}
+			dump_record(recs[i], count);
 			count++;
-		} catch (end_stream e) { break; }
+			start_time = 0;
+		}
 	}
 
 	return 0;
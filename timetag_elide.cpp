@@ -41,43 +41,49 @@ namespace po = boost::program_options;
 int main(int argc, char** argv) {
 	unsigned int drop_wraps = 0;
 	record_stream stream(stdin, drop_wraps);
-	try {
-		bool last_delta_valid = false;
-		record last_delta(0,0);
-		unsigned int i=0;
-		while (true) {
-			record r = stream.get_record();
-			write_record(stdout, r);
-			if (r.get_type() == record::DELTA) {
-				// Always keep the first 1000 delta events
-				last_delta = r;
-				last_delta_valid = true;
-				i++;
-				if (i > 1000)
-					break;
+	std::vector<record> recs(record_stream::chunk_records);
+	record_writer out(stdout);
+	size_t n;
+
+	bool initial = true;
+	bool last_delta_valid = false;
+	record last_delta(0,0);
+	unsigned int i=0;
+	bool write_next_delta = false;
+	while ((n = stream.read_records(&recs[0], recs.size())) > 0) {
+		const uint8_t* raw = stream.raw_records();
+		for (size_t j=0; j<n; j++) {
+			const record& r = recs[j];
+			const uint8_t* r_raw = raw + j*RECORD_LENGTH;
+			if (initial) {
+				out.write_raw(r_raw, 1);
+				if (r.get_type() == record::DELTA) {
+					// Always keep the first 1000 delta events
+					last_delta = r;
+					last_delta_valid = true;
+					i++;
+					if (i > 1000)
+						initial = false;
+				}
+				continue;
 			}
-		}
 
-		bool write_next_delta = false;
-		while (true) {
-			record r = stream.get_record();
 			if (r.get_type() == record::STROBE) {
 				if (last_delta_valid) {
-					write_record(stdout, last_delta);
+					out.write(last_delta);
 					last_delta_valid = false;
 				}
-				write_record(stdout, r);
+				out.write_raw(r_raw, 1);
 				write_next_delta = true;
 			} else {
 				if (write_next_delta) {
-					write_record(stdout, r);
+					out.write_raw(r_raw, 1);
 					write_next_delta = false;
 				} else {
 					last_delta_valid = true;
 					last_delta = r;
 				}
 			}
-			
 		}
-	} catch (end_stream e) { }
+	}
 }
@@ -23,18 +23,23 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <boost/format.hpp>
 
 #include "record.h"
+#include "record_parallel.h"
 
 using std::string;
 
 /*
  * Outputs binary timestamps from timetag data stream
  * Usage:
- *   timetag_extract [input-file]
+ *   timetag_extract [-j THREADS] [input-file]
  *
- *   Generates timestamp files for all non-empty channels
+ *   Generates timestamp files for all non-empty channels. Unpacked input
+ *   files are decoded on THREADS threads (by default one per CPU).
  *
  * Input:
  *   A binary photon stream
@@ -52,18 +57,22 @@ uint64_t first_delta_time;
 std::bitset<4> delta_states;
 bool first_delta;
 
-void process_record(record& r) {
+FILE* strobe_file(int i) {
+	if (strobe_out[i] == NULL) {
+		string name = str(boost::format("%s.strobe%d.times")
+				% root % (i+1));
+		strobe_out[i] = fopen(name.c_str(), "w");
+	}
+	return strobe_out[i];
+}
+
+void process_record(const record& r) {
 	std::bitset<4> channels = r.get_channels();
 	uint64_t time = r.get_time();
 	if (r.get_type() == record::type::STROBE) {
 		for (int i=0; i<4; i++) {
 			if (!channels[i]) continue;
-			if (strobe_out[i] == NULL) {
-				string name = str(boost::format("%s.strobe%d.times")
-						% root % (i+1));
-				strobe_out[i] = fopen(name.c_str(), "w");
-			}
-			fwrite((char*)&time, 8, 1, strobe_out[i]);
+			fwrite((char*)&time, 8, 1, strobe_file(i));
 		}
 	} else {
 		if (first_delta) {
@@ -91,23 +100,95 @@ void process_record(record& r) {
 	}
 }
 
+/*
+ * Strobe timestamps are extracted from each chunk of the file in
+ * parallel. Delta records are collected and handled serially when the
+ * chunk is merged since their output depends upon the preceding state.
+ */
+struct chunk_output {
+	std::array<std::vector<uint64_t>, 4> strobes;
+	std::vector<record> deltas;
+};
+
+void extract_parallel(const record_file& file, unsigned int n_threads) {
+	std::vector<chunk_output> outputs(n_threads);
+
+	auto process = [&](unsigned int slot, const record_chunk& chunk) {
+		chunk_output& out = outputs[slot];
+		record_range range = file.range(chunk.start, chunk.end, chunk.time_offset);
+		std::vector<record> recs(record_stream::chunk_records);
+		size_t n;
+		while ((n = range.read_records(&recs[0], recs.size())) > 0) {
+			for (size_t j=0; j<n; j++) {
+				const record& r = recs[j];
+				if (r.get_type() == record::type::DELTA) {
+					out.deltas.push_back(r);
+					continue;
+				}
+				std::bitset<4> channels = r.get_channels();
+				for (int i=0; i<4; i++) {
+					if (channels[i])
+						out.strobes[i].push_back(r.get_time());
+				}
+			}
+		}
+	};
+
+	auto merge = [&](unsigned int slot, const record_chunk& chunk) {
+		chunk_output& out = outputs[slot];
+		for (int i=0; i<4; i++) {
+			std::vector<uint64_t>& times = out.strobes[i];
+			if (!times.empty())
+				fwrite(&times[0], 8, times.size(), strobe_file(i));
+			times.clear();
+		}
+		for (auto r=out.deltas.begin(); r != out.deltas.end(); r++)
+			process_record(*r);
+		out.deltas.clear();
+	};
+
+	parallel_process(file, 0, 0, n_threads, process, merge);
+}
+
 int main(int argc, char** argv) {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s [input file]\n", argv[0]);
+	unsigned int n_threads = std::thread::hardware_concurrency();
+	int c;
+	while ((c = getopt(argc, argv, "j:")) != -1) {
+		switch (c) {
+		case 'j':
+			n_threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-j threads] [input file]\n", argv[0]);
+			exit(0);
+		}
+	}
+
+	if (argc - optind != 1) {
+		fprintf(stderr, "Usage: %s [-j threads] [input file]\n", argv[0]);
 		exit(0);
 	}
 
-	string name = string(argv[1]);
+	string name = string(argv[optind]);
 	root = name.substr(0, name.find_last_of("."));
-	FILE* infd = fopen(argv[1], "r");
+	FILE* infd = fopen(argv[optind], "r");
 	record_stream stream(infd);
+	std::vector<record> recs(record_stream::chunk_records);
+	size_t n;
+
+	// Only a regular file can be mapped to be split among threads
+	struct stat st;
+	bool seekable = fstat(fileno(infd), &st) == 0 && S_ISREG(st.st_mode);
 
 	first_delta = true;
-	while (true) {
-		try {
-			record r = stream.get_record();
-			process_record(r);
-		} catch (end_stream e) { break; }
+	if (n_threads > 1 && seekable && !stream.is_packed()) {
+		record_file file(fileno(infd));
+		extract_parallel(file, n_threads);
+	} else {
+		while ((n = stream.read_records(&recs[0], recs.size())) > 0) {
+			for (size_t i=0; i<n; i++)
+				process_record(recs[i]);
+		}
 	}
 
 	for (int i=0; i<4; i++) {
@@ -0,0 +1,227 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include "record.h"
+
+namespace po = boost::program_options;
+
+/*
+ *
+ * Accumulates histograms of the photon counts of temporal bins
+ *
+ * Usage:
+ *   timetag_hist [OPTIONS] BIN_LENGTH [input-file]
+ *
+ *   Bins the photon stream as timetag_bin does, with bins of BIN_LENGTH
+ *   counter units, and histograms
+ *
+ *     - the number of photons in each bin, for each strobe channel, in
+ *       COUNT_BINS bins of HIST_WIDTH photons. The last bin also holds
+ *       all larger counts.
+ *
+ *     - the FRET efficiency a / (a + d) of each bin with at least
+ *       THRESHOLD donor and acceptor photons, in FRET_BINS bins spanning
+ *       [0, 1].
+ *
+ * Output:
+ *   A snapshot of the histograms at the end of the input and, given
+ *   --snapshot-interval, each time that much time has passed in the
+ *   input. A snapshot is an array of 1 + 4*COUNT_BINS + FRET_BINS
+ *   native uint64_t values,
+ *
+ *     time, count histogram of channels 0-3, FRET histogram
+ *
+ *   where time is the start of the last complete bin. The array can be
+ *   read by a consumer with a single read, e.g. with np.frombuffer().
+ *   With --text each snapshot is instead given as a table terminated by
+ *   a blank line.
+ *
+ */
+
+struct hist_params {
+        count_t bin_length;
+        unsigned int hist_width, count_bins;
+        unsigned int donor, acceptor, threshold, fret_bins;
+};
+
+class hist_accumulator {
+        hist_params params;
+        bool started;
+        uint64_t bin_start;
+        unsigned int counts[4];
+        // The snapshot: time, then the count and FRET histograms
+        std::vector<uint64_t> snapshot;
+        uint64_t* count_hist;
+        uint64_t* fret_hist;
+
+        void add_bin(const unsigned int counts[4]) {
+                for (int c=0; c<4; c++) {
+                        unsigned int i = std::min(counts[c] / params.hist_width, params.count_bins - 1);
+                        count_hist[c*params.count_bins + i]++;
+                }
+
+                unsigned int d = counts[params.donor], a = counts[params.acceptor];
+                if (a + d > 0 && a + d >= params.threshold) {
+                        unsigned int i = params.fret_bins * a / (a + d);
+                        fret_hist[std::min(i, params.fret_bins - 1)]++;
+                }
+        }
+
+public:
+        hist_accumulator(const hist_params& params)
+                : params(params), started(false), bin_start(0), counts(),
+                  snapshot(1 + 4*params.count_bins + params.fret_bins, 0)
+        {
+                count_hist = &snapshot[1];
+                fret_hist = &snapshot[1 + 4*params.count_bins];
+        }
+
+        void handle_record(const record& r) {
+                uint64_t time = r.get_time();
+                if (!started) {
+                        // As in timetag_bin, the first record only starts the first bin
+                        bin_start = (time / params.bin_length) * params.bin_length;
+                        started = true;
+                        return;
+                }
+
+                if (time >= bin_start + params.bin_length) {
+                        uint64_t new_bin_start = (time / params.bin_length) * params.bin_length;
+                        add_bin(counts);
+                        snapshot[0] = bin_start;
+
+                        // Empty bins all fall in the first count bin
+                        uint64_t zeros = (new_bin_start - bin_start) / params.bin_length - 1;
+                        for (int c=0; c<4; c++)
+                                count_hist[c*params.count_bins] += zeros;
+                        if (zeros > 0)
+                                snapshot[0] = new_bin_start - params.bin_length;
+
+                        for (int c=0; c<4; c++)
+                                counts[c] = 0;
+                        bin_start = new_bin_start;
+                }
+
+                if (r.get_type() == record::type::STROBE) {
+                        std::bitset<4> channels = r.get_channels();
+                        for (int c=0; c<4; c++)
+                                counts[c] += channels[c];
+                }
+        }
+
+        uint64_t time() const { return snapshot[0]; }
+
+        void print() const {
+                if (fwrite(&snapshot[0], sizeof(uint64_t), snapshot.size(), stdout) != snapshot.size())
+                        throw std::runtime_error("failed to write snapshot");
+                fflush(stdout);
+        }
+
+        void print_text() const {
+                printf("# time %lu\n", snapshot[0]);
+                for (unsigned int i=0; i<params.count_bins; i++) {
+                        printf("%5u", i * params.hist_width);
+                        for (int c=0; c<4; c++)
+                                printf("\t%10lu", count_hist[c*params.count_bins + i]);
+                        printf("\n");
+                }
+                printf("# FRET efficiency\n");
+                for (unsigned int i=0; i<params.fret_bins; i++)
+                        printf("%6.3f\t%10lu\n", (double) i / params.fret_bins, fret_hist[i]);
+                printf("\n");
+                fflush(stdout);
+        }
+};
+
+int main(int argc, char** argv) {
+        hist_params params = { 0, 1, 256, 0, 1, 3, 20 };
+        count_t interval = 0;
+        std::string input;
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+                ("help,h", "Display help message")
+                ("bin-width", po::value<count_t>(&params.bin_length)->required(), "The desired bin width")
+                ("text,t", "Produce textual representation instead of usual binary output")
+                ("hist-width,w", po::value<unsigned int>(&params.hist_width), "photon counts per count histogram bin")
+                ("count-bins,n", po::value<unsigned int>(&params.count_bins), "bins in each count histogram")
+                ("donor,d", po::value<unsigned int>(&params.donor), "donor strobe channel")
+                ("acceptor,a", po::value<unsigned int>(&params.acceptor), "acceptor strobe channel")
+                ("threshold,T", po::value<unsigned int>(&params.threshold), "minimum photons in a bin for its FRET efficiency")
+                ("fret-bins,f", po::value<unsigned int>(&params.fret_bins), "bins in the FRET efficiency histogram")
+                ("snapshot-interval,u", po::value<count_t>(&interval), "write histograms every TIME counter units")
+                ("input", po::value<std::string>(&input), "record file to read instead of stdin");
+
+        po::positional_options_description pd;
+        pd.add("bin-width", 1);
+        pd.add("input", 1);
+
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
+
+        if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+        }
+        po::notify(vm);
+
+        if (params.bin_length == 0 || params.hist_width == 0 || params.count_bins == 0
+            || params.fret_bins == 0 || params.donor > 3 || params.acceptor > 3) {
+                std::cerr << "Widths and bin counts must be positive and channels in 0-3\n";
+                return 1;
+        }
+
+        FILE* in = stdin;
+        if (!input.empty() && (in = fopen(input.c_str(), "r")) == NULL) {
+                std::cerr << "Error opening " << input << "\n";
+                return 1;
+        }
+
+        bool text = vm.count("text");
+        hist_accumulator hist(params);
+        record_stream stream(in);
+        std::vector<record> recs(record_stream::chunk_records);
+        uint64_t next_snapshot = 0;
+        size_t n;
+        while ((n = stream.read_records(&recs[0], recs.size())) > 0) {
+                for (size_t i=0; i<n; i++) {
+                        hist.handle_record(recs[i]);
+                        if (interval == 0 || hist.time() < next_snapshot)
+                                continue;
+                        if (next_snapshot > 0)
+                                text ? hist.print_text() : hist.print();
+                        next_snapshot = hist.time() + interval;
+                }
+        }
+
+        text ? hist.print_text() : hist.print();
+        return 0;
+}
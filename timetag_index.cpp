@@ -0,0 +1,96 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#include <vector>
+#include <iostream>
+#include <boost/program_options.hpp>
+#include "record.h"
+#include "record_index.h"
+
+namespace po = boost::program_options;
+
+/*
+ * Builds a seek index for a record file.
+ *
+ * Usage:
+ *   timetag_index [--stride N] FILE
+ *       Writes FILE.idx
+ *
+ *   timetag_index [--stride N] --tee INDEX
+ *       Copies records from stdin to stdout, writing an index of them to
+ *       INDEX. This allows an index to be built while capturing, e.g.
+ *
+ *         timetag-cat | timetag_index --tee run.timetag.idx > run.timetag
+ */
+
+int main(int argc, char** argv) {
+        uint32_t stride = record_index_builder::default_stride;
+        std::string input, tee;
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+                ("help,h", "Display help message")
+                ("stride,k", po::value<uint32_t>(&stride), "records between index entries")
+                ("tee,T", po::value<std::string>(&tee), "copy stdin to stdout, indexing to the given file")
+                ("input", po::value<std::string>(&input), "record file to index");
+
+        po::positional_options_description pd;
+        pd.add("input", 1);
+
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
+        po::notify(vm);
+
+        if (vm.count("help") || input.empty() == tee.empty()) {
+                std::cout << desc << "\n";
+                return vm.count("help") ? 0 : 1;
+        }
+
+        FILE* in = stdin;
+        std::string index_path = tee;
+        if (!input.empty()) {
+                in = fopen(input.c_str(), "r");
+                if (in == NULL) {
+                        std::cerr << "Error opening " << input << "\n";
+                        return 1;
+                }
+                index_path = record_index::path_for(input);
+        }
+
+        record_stream stream(in);
+        record_index_builder builder(index_path.c_str(), stride);
+        std::vector<record> recs(record_stream::chunk_records);
+        record_writer* out = tee.empty() ? NULL : new record_writer(stdout);
+        size_t n;
+        while ((n = stream.read_records(&recs[0], recs.size())) > 0) {
+                if (out) {
+                        out->write_raw(stream.raw_records(), n);
+                        out->flush();
+                }
+                builder.add(&recs[0], n);
+        }
+
+        delete out;
+        builder.finish();
+        return 0;
+}
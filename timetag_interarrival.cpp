@@ -0,0 +1,272 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include "record.h"
+
+namespace po = boost::program_options;
+
+/*
+ *
+ * Histograms the times between photons
+ *
+ * Usage:
+ *   timetag_interarrival [OPTIONS] [input-file]
+ *
+ *   Accumulates, for each strobe channel, the histogram of times between
+ *   consecutive photons and, for each pair I,J given with --pair, the
+ *   start-stop histogram of the times from each photon on channel I to
+ *   every later photon on channel J within MAX_TIME. The latter is the
+ *   histogram used for antibunching (g2) measurements.
+ *
+ *   Only the last DEPTH photons of each channel are looked back at, so
+ *   start-stop histograms at high rates are truncated at the time
+ *   spanned by DEPTH photons.
+ *
+ *   Histograms have BINS bins spanning [0, MAX_TIME) counter units or,
+ *   with --log, logarithmically spaced bins spanning [MIN_TIME,
+ *   MAX_TIME). Shorter times fall in the first bin; longer times are
+ *   dropped.
+ *
+ * Output:
+ *   A snapshot of the histograms at the end of the input and, given
+ *   --snapshot-interval, each time that much time has passed in the
+ *   input. A snapshot is an array of 1 + (4 + PAIRS)*BINS native
+ *   uint64_t values,
+ *
+ *     time, histograms of channels 0-3, start-stop histogram of each pair
+ *
+ *   where time is that of the last record. With --text each snapshot is
+ *   instead given as a table, with the lower edge of each bin, terminated
+ *   by a blank line.
+ *
+ */
+
+struct channel_pair {
+        unsigned int start, stop;
+};
+
+class time_binning {
+        unsigned int n_bins;
+        count_t min_time, max_time;
+        bool log_bins;
+        double scale;
+
+public:
+        time_binning(unsigned int n_bins, count_t min_time, count_t max_time, bool log_bins)
+                : n_bins(n_bins), min_time(min_time), max_time(max_time), log_bins(log_bins)
+        {
+                if (log_bins)
+                        scale = n_bins / ::log((double) max_time / min_time);
+                else
+                        scale = (double) n_bins / max_time;
+        }
+
+        unsigned int size() const { return n_bins; }
+        count_t max() const { return max_time; }
+
+        // Bin of a time shorter than max()
+        unsigned int bin(count_t dt) const {
+                if (!log_bins)
+                        return dt * scale;
+                if (dt <= min_time)
+                        return 0;
+                return std::min<unsigned int>(::log((double) dt / min_time) * scale, n_bins - 1);
+        }
+
+        double lower_edge(unsigned int i) const {
+                return log_bins ? min_time * exp(i / scale) : i / scale;
+        }
+};
+
+/*
+ * The last photons of a channel, in a fixed ring
+ */
+class photon_history {
+        std::vector<uint64_t> times;
+        uint64_t n;
+
+public:
+        photon_history(unsigned int depth) : times(depth), n(0) { }
+
+        void add(uint64_t t) { times[n++ % times.size()] = t; }
+        size_t size() const { return std::min<uint64_t>(n, times.size()); }
+        // The i'th most recent photon
+        uint64_t operator[](size_t i) const { return times[(n - 1 - i) % times.size()]; }
+};
+
+class interarrival_hist {
+        time_binning binning;
+        std::vector<channel_pair> pairs;
+        std::vector<photon_history> history;
+        std::vector<uint64_t> snapshot;
+        uint64_t* interarrival;
+        uint64_t* start_stop;
+
+        void add(uint64_t* hist, count_t dt) {
+                if (dt < binning.max())
+                        hist[binning.bin(dt)]++;
+        }
+
+public:
+        interarrival_hist(const time_binning& binning, const std::vector<channel_pair>& pairs,
+                          unsigned int depth)
+                : binning(binning), pairs(pairs), history(4, photon_history(depth)),
+                  snapshot(1 + (4 + pairs.size()) * binning.size(), 0)
+        {
+                interarrival = &snapshot[1];
+                start_stop = &snapshot[1 + 4*binning.size()];
+        }
+
+        void handle_record(const record& r) {
+                if (r.get_type() != record::type::STROBE)
+                        return;
+                std::bitset<4> channels = r.get_channels();
+                if (channels.none())
+                        return;
+                uint64_t t = r.get_time();
+                snapshot[0] = t;
+
+                // Photons of this record are compared against earlier ones only
+                for (size_t p=0; p<pairs.size(); p++) {
+                        if (!channels[pairs[p].stop])
+                                continue;
+                        uint64_t* hist = &start_stop[p * binning.size()];
+                        const photon_history& h = history[pairs[p].start];
+                        for (size_t i=0; i<h.size() && t - h[i] < binning.max(); i++)
+                                hist[binning.bin(t - h[i])]++;
+                        if (pairs[p].start != pairs[p].stop && channels[pairs[p].start])
+                                hist[binning.bin(0)]++;
+                }
+
+                for (int c=0; c<4; c++) {
+                        if (!channels[c])
+                                continue;
+                        if (history[c].size() > 0)
+                                add(&interarrival[c * binning.size()], t - history[c][0]);
+                        history[c].add(t);
+                }
+        }
+
+        uint64_t time() const { return snapshot[0]; }
+
+        void print() const {
+                if (fwrite(&snapshot[0], sizeof(uint64_t), snapshot.size(), stdout) != snapshot.size())
+                        throw std::runtime_error("failed to write snapshot");
+                fflush(stdout);
+        }
+
+        void print_text() const {
+                printf("# time %lu\n", snapshot[0]);
+                for (unsigned int i=0; i<binning.size(); i++) {
+                        printf("%12.1f", binning.lower_edge(i));
+                        for (size_t h=0; h<4+pairs.size(); h++)
+                                printf("\t%10lu", interarrival[h*binning.size() + i]);
+                        printf("\n");
+                }
+                printf("\n");
+                fflush(stdout);
+        }
+};
+
+int main(int argc, char** argv) {
+        unsigned int n_bins = 1000, depth = 64;
+        count_t min_time = 1, max_time = 1 << 20, interval = 0;
+        std::vector<std::string> pair_args;
+        std::string input;
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+                ("help,h", "Display help message")
+                ("text,t", "Produce textual representation instead of usual binary output")
+                ("bins,n", po::value<unsigned int>(&n_bins), "bins in each histogram")
+                ("max-time,M", po::value<count_t>(&max_time), "longest time histogrammed, in counter units")
+                ("min-time,m", po::value<count_t>(&min_time), "lower edge of the second logarithmic bin")
+                ("log,l", "space bins logarithmically")
+                ("pair,p", po::value<std::vector<std::string>>(&pair_args), "start-stop histogram of channels I,J (may be repeated)")
+                ("depth,k", po::value<unsigned int>(&depth), "photons of each channel looked back at")
+                ("snapshot-interval,u", po::value<count_t>(&interval), "write histograms every TIME counter units")
+                ("input", po::value<std::string>(&input), "record file to read instead of stdin");
+
+        po::positional_options_description pd;
+        pd.add("input", 1);
+
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+        }
+
+        bool log_bins = vm.count("log");
+        if (n_bins == 0 || depth == 0 || max_time == 0 || (log_bins && (min_time == 0 || min_time >= max_time))) {
+                std::cerr << "Bins, depth and times must be positive and MIN_TIME below MAX_TIME\n";
+                return 1;
+        }
+
+        std::vector<channel_pair> pairs;
+        for (auto a=pair_args.begin(); a != pair_args.end(); a++) {
+                unsigned int i, j;
+                if (sscanf(a->c_str(), "%u,%u", &i, &j) != 2 || i > 3 || j > 3) {
+                        std::cerr << "Invalid channel pair " << *a << "\n";
+                        return 1;
+                }
+                pairs.push_back({ i, j });
+        }
+
+        FILE* in = stdin;
+        if (!input.empty() && (in = fopen(input.c_str(), "r")) == NULL) {
+                std::cerr << "Error opening " << input << "\n";
+                return 1;
+        }
+
+        bool text = vm.count("text");
+        interarrival_hist hist(time_binning(n_bins, min_time, max_time, log_bins), pairs, depth);
+        record_stream stream(in);
+        std::vector<record> recs(record_stream::chunk_records);
+        uint64_t next_snapshot = 0;
+        size_t n;
+        while ((n = stream.read_records(&recs[0], recs.size())) > 0) {
+                for (size_t i=0; i<n; i++) {
+                        hist.handle_record(recs[i]);
+                        if (interval == 0 || hist.time() < next_snapshot)
+                                continue;
+                        if (next_snapshot > 0)
+                                text ? hist.print_text() : hist.print();
+                        next_snapshot = hist.time() + interval;
+                }
+        }
+
+        text ? hist.print_text() : hist.print();
+        return 0;
+}
@@ -0,0 +1,66 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#include <vector>
+#include <iostream>
+#include <boost/program_options.hpp>
+#include "record.h"
+#include "record_pack.h"
+
+namespace po = boost::program_options;
+
+/*
+ * Compresses a record stream into the packed container format (see
+ * record_pack.h). All tools reading records accept packed input; use
+ * timetag_unpack to recover the original file.
+ *
+ * Usage:
+ *   timetag_pack [--block-records N] < in.timetag > out.timetag.pk
+ */
+
+int main(int argc, char** argv) {
+        uint32_t block_records = pack_writer::default_block_records;
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+                ("help,h", "Display help message")
+                ("block-records,b", po::value<uint32_t>(&block_records), "records per block");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+                std::cout << desc << "\n";
+                return 0;
+        }
+
+        record_stream stream(stdin);
+        pack_writer out(fileno(stdout), block_records);
+        std::vector<record> recs(record_stream::chunk_records);
+        size_t n;
+        while ((n = stream.read_records(&recs[0], recs.size())) > 0)
+                out.add(&recs[0], n);
+        out.finish();
+        return 0;
+}
@@ -0,0 +1,43 @@
+// vim: set fileencoding=utf-8 noet :
+
+/* timetag-tools - Tools for UMass FPGA timetagger
+ *
+ * Copyright © 2010 Ben Gamari
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Ben Gamari <bgamari@physics.umass.edu>
+ */
+
+
+#include <vector>
+#include "record.h"
+
+/*
+ * Expands a packed record stream (see timetag_pack) back into the usual
+ * record format. Unpacked input is copied unchanged.
+ *
+ * Usage:
+ *   timetag_unpack < in.timetag.pk > out.timetag
+ */
+
+int main(int argc, char** argv) {
+	record_stream stream(stdin);
+	record_writer out(stdout);
+	std::vector<record> recs(record_stream::chunk_records);
+	size_t n;
+	while ((n = stream.read_records(&recs[0], recs.size())) > 0)
+		out.write_raw(stream.raw_records(), n);
+	return 0;
+}
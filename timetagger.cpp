@@ -27,6 +27,8 @@
 #include <unistd.h>
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
 #include "timetagger.h"
 #include "record_format.h"
 
@@ -36,6 +38,15 @@
 
 #define TIMEOUT 500
 
+// Register commands in flight at once
+#define REG_PIPELINE_DEPTH 16
+
+// Largest packet the device sends on the data endpoint
+#define MAX_PACKET_SIZE 512
+// Space before each readout buffer for the bytes of a record begun by
+// the previous transfer
+#define READOUT_HEADROOM 8
+
 
 #define REQ_TYPE_TO_DEV		(0x0 << 0)
 #define REQ_TYPE_TO_IFACE	(0x1 << 0)
@@ -74,96 +85,171 @@ timetagger::timetagger(libusb_context* ctx, libusb_device_handle* dev, data_cb_t
 	ctx(ctx),
 	dev(dev),
 	needs_flush(false),
+	n_transfers(TIMETAG_READOUT_TRANSFERS),
+	transfer_size(TIMETAG_READOUT_TRANSFER_SIZE),
+	in_flight(0),
+	failed_xfers(0),
+	carry_len(0),
 	data_cb(data_cb)
 {
 #ifdef DEBUG
 	libusb_set_debug(ctx, 3);
 #endif
 	libusb_claim_interface(dev, 0);
+
+	for (int i=0; i<2*REG_PIPELINE_DEPTH; i++) {
+		libusb_transfer* transfer = libusb_alloc_transfer(0);
+		if (transfer == NULL) {
+			fprintf(log_file, "Error allocating transfer for register command\n");
+			throw std::runtime_error("Error allocating transfer for register command\n");
+		}
+		reg_xfers.push_back(transfer);
+	}
+	reg_bufs.resize(REG_PIPELINE_DEPTH);
+
 	// Set send window to maximum value
-	set_send_window(512/RECORD_LENGTH);
+	set_send_window_bytes(MAX_PACKET_SIZE);
 
 	// Start things off with sane defaults
 	write_reg(0x0, 0x00); // Possibly unjam register manager
 	flush_fx2_fifo();
-	write_reg(CAPCTL_REG, 0x00);
-	write_reg(STROBE_REG, 0x0f); // Strobe channel control
-	write_reg(DELTA_REG, 0x0f); // Delta channel control
 
-	// Update register cache
+	// Write the defaults and fill the register cache in one exchange
+	std::vector<reg_op> ops = {
+		{ true, CAPCTL_REG, 0x00 },
+		{ true, STROBE_REG, 0x0f }, // Strobe channel control
+		{ true, DELTA_REG, 0x0f },  // Delta channel control
+	};
 	for (int i=1; i<TIMETAG_NREGS; i++)
-		read_reg(i);
+		ops.push_back({ false, (uint16_t) i, 0 });
+	reg_cmds(&ops[0], ops.size());
+	status_time = std::chrono::steady_clock::now();
 }
 
 timetagger::~timetagger()
 {
 	stop_readout();
+	for (auto transfer : reg_xfers)
+		libusb_free_transfer(transfer);
 	libusb_release_interface(dev, 0);
 }
 
-uint32_t timetagger::reg_cmd(bool write, uint16_t reg, uint32_t val)
-{
-	int ret;
-	uint8_t buffer[] = { 0xAA, (uint8_t) write,
-		(uint8_t) (reg >> 0),
-		(uint8_t) (reg >> 8),
-		(uint8_t) (val >> 0),
-		(uint8_t) (val >> 8),
-		(uint8_t) (val >> 16),
-		(uint8_t) (val >> 24),
-	};
+// Completions may be handled on another thread as we submit
+struct reg_batch_state {
+	std::atomic<int> pending;
+	int completed;
 
-	int completed = 0;
-	libusb_transfer* transfer = libusb_alloc_transfer(0);
-	if (transfer == NULL) {
-		fprintf(log_file, "Error allocating transfer for register command\n");
-		throw std::runtime_error("Error allocating transfer for register command\n");
+	void done(int n) {
+		if (pending.fetch_sub(n) == n)
+			completed = 1;
 	}
-	
+};
+
+static void LIBUSB_CALL reg_batch_cb(libusb_transfer *transfer)
+{
+	((reg_batch_state *) transfer->user_data)->done(1);
+}
+
+/*
+ * Execute a batch of register commands. Up to REG_PIPELINE_DEPTH
+ * commands are sent at once, each with a reply transfer queued behind
+ * it. The device answers commands in the order received and transfers on
+ * an endpoint complete in the order submitted, so the ith reply belongs
+ * to the ith command. Each op's val receives the register's value.
+ */
+void timetagger::reg_cmds(reg_op* ops, size_t n)
+{
+	std::lock_guard<std::mutex> lock(reg_lock);
+	for (size_t start=0; start<n; start+=REG_PIPELINE_DEPTH) {
+		size_t m = std::min<size_t>(n - start, REG_PIPELINE_DEPTH);
+		reg_batch_state state;
+		state.pending = 2*m + 1;
+		state.completed = 0;
+		int submitted = 0;
+		const char *error = NULL;
+
+		for (size_t i=0; i<m && !error; i++) {
+			const reg_op& op = ops[start+i];
+			uint8_t *cmd = reg_bufs[i].cmd;
+			cmd[0] = 0xAA;
+			cmd[1] = op.write;
+			cmd[2] = op.reg >> 0;
+			cmd[3] = op.reg >> 8;
+			cmd[4] = op.val >> 0;
+			cmd[5] = op.val >> 8;
+			cmd[6] = op.val >> 16;
+			cmd[7] = op.val >> 24;
+
 #ifdef DEBUG
-	fprintf(log_file, "%s reg %04x = %08x; ", write ? "write" : "read", reg, val);
+			fprintf(log_file, "%s reg %04x = %08x\n", op.write ? "write" : "read", op.reg, op.val);
 #endif
 
-	// Submit request
-	libusb_fill_bulk_transfer(transfer, dev, CMD_ENDP, buffer, 8,
-			 	  completed_cb, &completed, TIMEOUT);
-	ret = libusb_submit_transfer(transfer);
-	if (ret) {
-		fprintf(log_file, "Failed to send request: %d\n", ret);
-		throw std::runtime_error("Failed to send request");
-	}
-
-	while (!completed)
-		libusb_handle_events_completed(ctx, &completed);
+			libusb_transfer *req = reg_xfers[2*i], *reply = reg_xfers[2*i+1];
+			libusb_fill_bulk_transfer(req, dev, CMD_ENDP, cmd, 8,
+						  reg_batch_cb, &state, TIMEOUT);
+			libusb_fill_bulk_transfer(reply, dev, REPLY_ENDP, reg_bufs[i].reply, 4,
+						  reg_batch_cb, &state, TIMEOUT);
 
-	// Read reply
-	completed = 0;
-	libusb_fill_bulk_transfer(transfer, dev, REPLY_ENDP, buffer, 4,
-			 	  completed_cb, &completed, TIMEOUT);
-	ret = libusb_submit_transfer(transfer);
-	if (ret) {
-		fprintf(log_file, "Failed to receive reply: %d\n", ret);
-		throw std::runtime_error("Failed to receive reply");
-	}
+			int ret = libusb_submit_transfer(req);
+			if (ret) {
+				fprintf(log_file, "Failed to send request: %d\n", ret);
+				error = "Failed to send request";
+				break;
+			}
+			submitted++;
 
-	while (!completed)
-		libusb_handle_events_completed(ctx, &completed);
+			ret = libusb_submit_transfer(reply);
+			if (ret) {
+				fprintf(log_file, "Failed to receive reply: %d\n", ret);
+				error = "Failed to receive reply";
+				break;
+			}
+			submitted++;
+		}
 
+		// Wait for everything submitted, whether or not all was. The
+		// extra count held above keeps early completions from finishing
+		// the batch before it is all submitted.
+		state.done(2*m + 1 - submitted);
+		while (!state.completed)
+			libusb_handle_events_completed(ctx, &state.completed);
+		if (error)
+			throw std::runtime_error(error);
+
+		for (size_t i=0; i<m; i++) {
+			libusb_transfer *reply = reg_xfers[2*i+1];
 #ifdef DEBUG
-	fprintf(log_file, "reply: ");
-	for (int i=0; i<transfer->actual_length; i++)
-		fprintf(log_file, " %02x ", buffer[i]);
-	fprintf(log_file, "\n");
+			fprintf(log_file, "reply: ");
+			for (int j=0; j<reply->actual_length; j++)
+				fprintf(log_file, " %02x ", reg_bufs[i].reply[j]);
+			fprintf(log_file, "\n");
 #endif
+			if (reply->status != LIBUSB_TRANSFER_COMPLETED || reply->actual_length != 4) {
+				fprintf(log_file, "Invalid reply (length=%d)\n", reply->actual_length);
+				throw std::runtime_error("Invalid reply");
+			}
 
-	if (transfer->actual_length != 4) {
-		fprintf(log_file, "Invalid reply (length=%d)\n", transfer->actual_length);
-		throw std::runtime_error("Invalid reply");
+			reg_op& op = ops[start+i];
+			memcpy(&op.val, reg_bufs[i].reply, 4);
+			if (op.reg < TIMETAG_NREGS)
+				regs[op.reg] = op.val;
+		}
 	}
+}
 
-	libusb_free_transfer(transfer);
-	regs[reg] = *((uint32_t*) buffer);
-	return regs[reg];
+uint32_t timetagger::reg_cmd(bool write, uint16_t reg, uint32_t val)
+{
+	reg_op op = { write, reg, val };
+	reg_cmds(&op, 1);
+	return op.val;
+}
+
+void timetagger::read_regs(const uint16_t* addrs, size_t n)
+{
+	std::vector<reg_op> ops(n);
+	for (size_t i=0; i<n; i++)
+		ops[i] = { false, addrs[i], 0 };
+	reg_cmds(ops.data(), n);
 }
 
 uint32_t timetagger::read_reg(uint16_t reg)
@@ -171,6 +257,62 @@ uint32_t timetagger::read_reg(uint16_t reg)
 	return reg_cmd(false, reg, 0x0);
 }
 
+/*
+ * Only the counters and capture control change other than by our own
+ * writes. The rest of the registers are owned by the host and may be
+ * served from the cache.
+ */
+static bool is_volatile_reg(uint16_t reg)
+{
+	return reg == CAPCTL_REG || reg == REC_COUNTER_REG || reg == LOST_COUNTER_REG;
+}
+
+uint32_t timetagger::cached_reg(uint16_t reg)
+{
+	std::lock_guard<std::mutex> lock(reg_lock);
+	return regs[reg];
+}
+
+uint32_t timetagger::get_reg(uint16_t reg)
+{
+	if (is_volatile_reg(reg) || reg >= TIMETAG_NREGS)
+		return read_reg(reg);
+	return cached_reg(reg);
+}
+
+void timetagger::refresh_status()
+{
+	const uint16_t volatile_regs[] = { CAPCTL_REG, REC_COUNTER_REG, LOST_COUNTER_REG };
+	read_regs(volatile_regs, 3);
+	std::lock_guard<std::mutex> lock(reg_lock);
+	status_time = std::chrono::steady_clock::now();
+}
+
+timetagger::status timetagger::get_status()
+{
+	std::lock_guard<std::mutex> lock(reg_lock);
+	status s;
+	s.time = status_time;
+	s.version = regs[VERSION_REG];
+	s.clockrate = regs[CLOCKRATE_REG];
+	s.capture_en = regs[CAPCTL_REG] & CAPCTL_CAPTURE_EN;
+	s.record_count = regs[REC_COUNTER_REG];
+	s.lost_record_count = regs[LOST_COUNTER_REG];
+	s.strobe_operate = regs[STROBE_REG] & 0xf;
+	s.delta_operate = regs[DELTA_REG] & 0xf;
+	s.seq_operate = regs[SEQ_REG] & 0x1;
+	s.seq_clockrate = regs[SEQ_CLOCKRATE_REG];
+	for (unsigned int i=0; i<TIMETAG_NSEQCHANS; i++) {
+		unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*i;
+		s.seqchans[i].operate = regs[base_reg] & 0x1;
+		s.seqchans[i].initial_state = regs[base_reg] & 0x02;
+		s.seqchans[i].initial_count = regs[base_reg+1];
+		s.seqchans[i].low_count = regs[base_reg+2];
+		s.seqchans[i].high_count = regs[base_reg+3];
+	}
+	return s;
+}
+
 void timetagger::write_reg(uint16_t reg, uint32_t val)
 {
 	reg_cmd(true, reg, val);
@@ -179,37 +321,37 @@ void timetagger::write_reg(uint16_t reg, uint32_t val)
 void timetagger::set_strobe_operate(unsigned int channel, bool enabled)
 {
 	if (enabled)
-		write_reg(STROBE_REG, regs[STROBE_REG] | (1 << channel));
+		write_reg(STROBE_REG, cached_reg(STROBE_REG) | (1 << channel));
 	else
-		write_reg(STROBE_REG, regs[STROBE_REG] & ~(1 << channel));
+		write_reg(STROBE_REG, cached_reg(STROBE_REG) & ~(1 << channel));
 }
 
 bool timetagger::get_strobe_operate(unsigned int channel)
 {
-	return read_reg(STROBE_REG) & (1<<channel);
+	return get_reg(STROBE_REG) & (1<<channel);
 }
 
 void timetagger::set_delta_operate(unsigned int channel, bool enabled)
 {
 	if (enabled)
-		write_reg(DELTA_REG, regs[DELTA_REG] | (1 << channel));
+		write_reg(DELTA_REG, cached_reg(DELTA_REG) | (1 << channel));
 	else
-		write_reg(DELTA_REG, regs[DELTA_REG] & ~(1 << channel));
+		write_reg(DELTA_REG, cached_reg(DELTA_REG) & ~(1 << channel));
 }
 
 bool timetagger::get_delta_operate(unsigned int channel)
 {
-	return read_reg(DELTA_REG) & (1<<channel);
+	return get_reg(DELTA_REG) & (1<<channel);
 }
 
 unsigned int timetagger::get_version()
 {
-	return read_reg(VERSION_REG);
+	return get_reg(VERSION_REG);
 }
 
 unsigned int timetagger::get_clockrate()
 {
-	return read_reg(CLOCKRATE_REG);
+	return get_reg(CLOCKRATE_REG);
 }
 
 void timetagger::start_capture()
@@ -217,30 +359,30 @@ void timetagger::start_capture()
 	// Don't start capture until flush has finished
 	while (needs_flush)
 		sleep(1);
-	write_reg(CAPCTL_REG, regs[CAPCTL_REG] | CAPCTL_CAPTURE_EN | CAPCTL_COUNT_EN);
+	write_reg(CAPCTL_REG, cached_reg(CAPCTL_REG) | CAPCTL_CAPTURE_EN | CAPCTL_COUNT_EN);
 }
 
 void timetagger::stop_capture()
 {
-	write_reg(CAPCTL_REG, regs[CAPCTL_REG] & ~CAPCTL_CAPTURE_EN);
+	write_reg(CAPCTL_REG, cached_reg(CAPCTL_REG) & ~CAPCTL_CAPTURE_EN);
 }
 
 bool timetagger::get_capture_en()
 {
-	return read_reg(CAPCTL_REG) & CAPCTL_CAPTURE_EN;
+	return get_reg(CAPCTL_REG) & CAPCTL_CAPTURE_EN;
 }
 
 void timetagger::reset_counter()
 {
-	write_reg(CAPCTL_REG, (regs[CAPCTL_REG] | CAPCTL_RESET_CNT) & ~CAPCTL_COUNT_EN);
-	write_reg(CAPCTL_REG, regs[CAPCTL_REG] & ~CAPCTL_RESET_CNT);
+	write_reg(CAPCTL_REG, (cached_reg(CAPCTL_REG) | CAPCTL_RESET_CNT) & ~CAPCTL_COUNT_EN);
+	write_reg(CAPCTL_REG, cached_reg(CAPCTL_REG) & ~CAPCTL_RESET_CNT);
 
         // Flush
 	stop_capture();
 
 	// Clear sample FIFO
-	write_reg(REC_FIFO_REG, regs[REC_FIFO_REG] | 0x1);
-	write_reg(REC_FIFO_REG, regs[REC_FIFO_REG] & ~0x1);
+	write_reg(REC_FIFO_REG, cached_reg(REC_FIFO_REG) | 0x1);
+	write_reg(REC_FIFO_REG, cached_reg(REC_FIFO_REG) & ~0x1);
 
 	flush_fx2_fifo();
 	needs_flush = true;
@@ -248,25 +390,25 @@ void timetagger::reset_counter()
 
 unsigned int timetagger::get_record_count()
 {
-	return read_reg(REC_COUNTER_REG);
+	return get_reg(REC_COUNTER_REG);
 }
 
 unsigned int timetagger::get_lost_record_count()
 {
-	return read_reg(LOST_COUNTER_REG);
+	return get_reg(LOST_COUNTER_REG);
 }
 
 void timetagger::set_global_sequencer_operate(bool operate)
 {
 	if (operate)
-		write_reg(SEQ_REG, regs[SEQ_REG] | 0x1);
+		write_reg(SEQ_REG, cached_reg(SEQ_REG) | 0x1);
 	else
-		write_reg(SEQ_REG, regs[SEQ_REG] & ~0x1);
+		write_reg(SEQ_REG, cached_reg(SEQ_REG) & ~0x1);
 }
 
 bool timetagger::get_global_sequencer_operate()
 {
-	return read_reg(SEQ_REG) & 0x1;
+	return get_reg(SEQ_REG) & 0x1;
 }
 
 void timetagger::reset_sequencer()
@@ -277,31 +419,46 @@ void timetagger::reset_sequencer()
 
 unsigned int timetagger::get_seq_clockrate()
 {
-	return read_reg(SEQ_CLOCKRATE_REG);
+	return get_reg(SEQ_CLOCKRATE_REG);
 }
 
 void timetagger::set_seqchan_operate(unsigned int seq, bool operate)
 {
 	unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*seq;
 	if (operate)
-		write_reg(base_reg, regs[base_reg] | 0x1);
+		write_reg(base_reg, cached_reg(base_reg) | 0x1);
 	else
-		write_reg(base_reg, regs[base_reg] & ~0x1);
+		write_reg(base_reg, cached_reg(base_reg) & ~0x1);
 }
 
 bool timetagger::get_seqchan_operate(unsigned int seq)
 {
 	unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*seq;
-	return read_reg(base_reg) & 0x1;
+	return get_reg(base_reg) & 0x1;
+}
+
+void timetagger::set_seqchan_config(unsigned int seq, bool initial_state, uint32_t initial_count,
+				    uint32_t low_count, uint32_t high_count)
+{
+	unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*seq;
+	uint32_t config = cached_reg(base_reg);
+	config = initial_state ? config | 0x02 : config & ~0x02;
+	reg_op ops[] = {
+		{ true, (uint16_t) base_reg, config },
+		{ true, (uint16_t) (base_reg+1), initial_count },
+		{ true, (uint16_t) (base_reg+2), low_count },
+		{ true, (uint16_t) (base_reg+3), high_count },
+	};
+	reg_cmds(ops, 4);
 }
 
 void timetagger::set_seqchan_initial_state(unsigned int seq, bool initial_state)
 {
 	unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*seq;
 	if (initial_state)
-		write_reg(base_reg, regs[base_reg] | 0x02); 
+		write_reg(base_reg, cached_reg(base_reg) | 0x02); 
 	else
-		write_reg(base_reg, regs[base_reg] & ~0x02); 
+		write_reg(base_reg, cached_reg(base_reg) & ~0x02); 
 }
 
 void timetagger::set_seqchan_initial_count(unsigned int seq, uint32_t initial_count)
@@ -325,31 +482,41 @@ void timetagger::set_seqchan_high_count(unsigned int seq, uint32_t high_count)
 bool timetagger::get_seqchan_initial_state(unsigned int seq)
 {
 	unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*seq;
-	return read_reg(base_reg) & 0x02;
+	return get_reg(base_reg) & 0x02;
 }
 
 uint32_t timetagger::get_seqchan_initial_count(unsigned int seq)
 {
 	unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*seq;
-	return read_reg(base_reg+1);
+	return get_reg(base_reg+1);
 }
 
 uint32_t timetagger::get_seqchan_low_count(unsigned int seq)
 {
 	unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*seq;
-	return read_reg(base_reg+2);
+	return get_reg(base_reg+2);
 }
 
 uint32_t timetagger::get_seqchan_high_count(unsigned int seq)
 {
 	unsigned int base_reg = SEQ_CONFIG_BASE + 0x8*seq;
-	return read_reg(base_reg+3);
+	return get_reg(base_reg+3);
 }
 
 void timetagger::set_send_window(unsigned int records)
 {
-	unsigned int bytes = RECORD_LENGTH*records;
-	if (bytes > 512) {
+	set_send_window_bytes(RECORD_LENGTH*records);
+}
+
+/*
+ * Set the length of the packets the device commits to the data
+ * endpoint. A packet shorter than MAX_PACKET_SIZE ends a bulk transfer,
+ * so only full-size packets allow transfers to span many packets. These
+ * split records across packets, which readout reassembles.
+ */
+void timetagger::set_send_window_bytes(unsigned int bytes)
+{
+	if (bytes > MAX_PACKET_SIZE) {
 		fprintf(log_file, "Error: Send window too large\n");
 		return;
 	}
@@ -376,7 +543,7 @@ void timetagger::set_send_window(unsigned int records)
 		libusb_handle_events_completed(ctx, &completed);
 
 	libusb_free_transfer(transfer);
-	send_window = records;
+	send_window = bytes;
 }
 
 // Request FIFO flush
@@ -440,21 +607,170 @@ void timetagger::do_flush()
 	needs_flush = false;
 }
 
-void timetagger::readout_handler()
+void timetagger::set_readout_transfers(unsigned int n)
+{
+	n_transfers = std::max(1U, n);
+}
+
+void timetagger::set_readout_transfer_size(unsigned int bytes)
+{
+	// Bulk IN transfers should be a whole number of packets
+	unsigned int packets = (bytes + MAX_PACKET_SIZE - 1) / MAX_PACKET_SIZE;
+	transfer_size = std::max(1U, packets) * MAX_PACKET_SIZE;
+}
+
+/*
+ * Queue a readout transfer, taking a free buffer if it needs one. Called
+ * with readout_lock held.
+ */
+bool timetagger::submit_readout(readout_transfer& rt)
 {
 	const int data_timeout = 500;
-	int failed_xfers = 0;
-	uint8_t* buffer = new uint8_t[510];
+	if (rt.buffer == NULL) {
+		// Wait for the readout thread to return a buffer
+		if (free_buffers.empty())
+			return false;
+		rt.buffer = free_buffers.back();
+		free_buffers.pop_back();
+	}
 
-	libusb_transfer *transfer = libusb_alloc_transfer(0);
-	if (transfer == NULL) {
-		fprintf(log_file, "Error allocating transfer for readout\n");
-		throw std::runtime_error("Error allocating transfer for readout\n");
+	libusb_fill_bulk_transfer(rt.transfer, dev, DATA_ENDP, rt.buffer, transfer_size,
+				  readout_cb, &rt, data_timeout);
+	int res = libusb_submit_transfer(rt.transfer);
+	if (res) {
+		fprintf(log_file, "Failed to submit readout transfer: %d\n", res);
+		return false;
+	}
+	rt.queued = true;
+	in_flight++;
+	return true;
+}
+
+/*
+ * Called from whichever thread is handling libusb events. Takes the
+ * received data and requeues the transfer before anything else is done
+ * with it.
+ */
+void LIBUSB_CALL timetagger::readout_cb(libusb_transfer* transfer)
+{
+	readout_transfer* rt = (readout_transfer*) transfer->user_data;
+	timetagger* tt = rt->tt;
+	std::lock_guard<std::mutex> lock(tt->readout_lock);
+	rt->queued = false;
+	tt->in_flight--;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+	case LIBUSB_TRANSFER_OVERFLOW:
+		tt->failed_xfers = 0;
+		// Fall through
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		// Timeouts let us check needs_flush but may still carry data
+#ifdef DEBUG
+		fprintf(log_file, "Read %d bytes (status=%d)\n",
+			transfer->actual_length, transfer->status);
+#endif
+		if (transfer->actual_length > 0) {
+			tt->completed_blocks.push_back({ rt->buffer, (size_t) transfer->actual_length });
+			rt->buffer = NULL;
+		}
+		break;
+
+	case LIBUSB_TRANSFER_CANCELLED:
+		return;
+
+	case LIBUSB_TRANSFER_ERROR:
+		fprintf(log_file, "Readout transfer failed\n");
+		tt->failed_xfers++;
+		if (tt->failed_xfers > 1000) {
+			fprintf(log_file, "Too many failed transfers. Read-out stopped\n");
+			tt->_stop_readout = true;
+		}
+		break;
+
+	default:
+		fprintf(log_file, "Odd transfer status in readout: %d\n", transfer->status);
+		break;
+	}
+
+	if (!tt->_stop_readout && !tt->needs_flush)
+		tt->submit_readout(*rt);
+}
+
+// Cancel all queued readout transfers and wait for them to finish
+void timetagger::cancel_readout()
+{
+	{
+		std::lock_guard<std::mutex> lock(readout_lock);
+		for (auto& rt : readout_xfers)
+			if (rt.queued)
+				libusb_cancel_transfer(rt.transfer);
+	}
+
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(readout_lock);
+			if (in_flight == 0)
+				break;
+		}
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	}
+}
+
+/*
+ * Pass received buffers to data_cb in order and return them to the pool.
+ * The bytes of a record left incomplete at the end of a buffer are
+ * carried over and copied into the headroom in front of the next, so
+ * data_cb sees only whole records without the data itself being copied.
+ */
+void timetagger::deliver_blocks()
+{
+	std::deque<readout_block> blocks;
+	{
+		std::lock_guard<std::mutex> lock(readout_lock);
+		blocks.swap(completed_blocks);
+	}
+
+	for (auto& b : blocks) {
+		uint8_t* start = b.buffer - carry_len;
+		memcpy(start, carry, carry_len);
+		size_t length = carry_len + b.length;
+		size_t whole = length - length % RECORD_LENGTH;
+
+		carry_len = length - whole;
+		memcpy(carry, start + whole, carry_len);
+		if (whole > 0)
+			data_cb(start, whole);
+	}
+
+	std::lock_guard<std::mutex> lock(readout_lock);
+	for (auto& b : blocks)
+		free_buffers.push_back(b.buffer);
+}
+
+void timetagger::readout_handler()
+{
+	// Twice as many buffers as transfers leaves each transfer a spare
+	// to be resubmitted with while data_cb works through the last
+	const size_t stride = READOUT_HEADROOM + transfer_size;
+	readout_storage.assign(2 * n_transfers * stride, 0);
+	free_buffers.clear();
+	for (unsigned int i=0; i<2*n_transfers; i++)
+		free_buffers.push_back(&readout_storage[i*stride + READOUT_HEADROOM]);
+	carry_len = 0;
+
+	readout_xfers.resize(n_transfers);
+	for (auto& rt : readout_xfers) {
+		rt.tt = this;
+		rt.buffer = NULL;
+		rt.queued = false;
+		rt.transfer = libusb_alloc_transfer(0);
+		if (rt.transfer == NULL) {
+			fprintf(log_file, "Error allocating transfer for readout\n");
+			throw std::runtime_error("Error allocating transfer for readout\n");
+		}
 	}
-	
-	int completed;
-	libusb_fill_bulk_transfer(transfer, dev, DATA_ENDP, buffer, 510,
-			 	  completed_cb, &completed, data_timeout);
 
 	// Try bumping up ourselves into the FIFO scheduler 
 	sched_param sp;
@@ -463,55 +779,36 @@ void timetagger::readout_handler()
 		fprintf(log_file, "FIFO scheduling failed\n");
 
 	while (!_stop_readout) {
-		completed = 0;
-		if (needs_flush)
+		if (needs_flush) {
+			cancel_readout();
+			deliver_blocks();
+			carry_len = 0;
 			do_flush();
-
-		int res = libusb_submit_transfer(transfer);
-		if (res) {
-			fprintf(log_file, "Failed to send request: %d\n", res);
-			throw std::runtime_error("Failed to send request");
 		}
 
-		while (!completed && !_stop_readout)
-			libusb_handle_events_completed(ctx, &completed);
-
-		if (_stop_readout) break;
-
-		switch (transfer->status) {
-		case LIBUSB_TRANSFER_COMPLETED:
-		case LIBUSB_TRANSFER_OVERFLOW:
-#ifdef DEBUG
-			fprintf(log_file, "Read %d bytes (status=%d, res=%d)\n",
-				transfer->actual_length, transfer->status, res);
-#endif
-			if (transfer->actual_length % RECORD_LENGTH != 0)
-				fprintf(log_file, "Warning: Received partial record.");
-			data_cb(buffer, transfer->actual_length);
-			failed_xfers = 0;
-			break;
-
-		case LIBUSB_TRANSFER_TIMED_OUT:
-			// Ignore timeouts so we can check needs_flush
-			break;
-
-		case LIBUSB_TRANSFER_ERROR:
-			fprintf(log_file, "Readout transfer failed: %d\n", res);
-			failed_xfers++;
-			if (failed_xfers > 1000) {
-				fprintf(log_file, "Too many failed transfers. Read-out stopped\n");
-				break;
+		// Queue any transfers left idle by a flush or a lack of buffers
+		{
+			std::lock_guard<std::mutex> lock(readout_lock);
+			for (auto& rt : readout_xfers) {
+				if (rt.queued || needs_flush || _stop_readout)
+					continue;
+				if (!submit_readout(rt) && rt.buffer != NULL) {
+					fprintf(log_file, "Failed to send request\n");
+					throw std::runtime_error("Failed to send request");
+				}
 			}
-			break;
-		
-		default:
-			fprintf(log_file, "Odd transfer status in readout: %d\n", transfer->status);
-			break;
 		}
+
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		deliver_blocks();
 	}
 
-	libusb_free_transfer(transfer);
-	delete [] buffer;
+	cancel_readout();
+	deliver_blocks();
+	for (auto& rt : readout_xfers)
+		libusb_free_transfer(rt.transfer);
+	readout_xfers.clear();
 }
 
 void timetagger::start_readout() 
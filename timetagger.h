@@ -29,11 +29,19 @@
 #include <array>
 #include <memory>
 #include <thread>
+#include <mutex>
+#include <deque>
+#include <chrono>
 #include <functional>
 
 #include "record_format.h"
 
 #define TIMETAG_NREGS 0x50
+#define TIMETAG_NSEQCHANS 4
+// Default number of readout transfers kept queued on the data endpoint
+#define TIMETAG_READOUT_TRANSFERS 8
+// Default size of each readout transfer in bytes
+#define TIMETAG_READOUT_TRANSFER_SIZE (64*1024)
 
 extern FILE* log_file;
 
@@ -48,25 +56,119 @@ private:
 	bool _stop_readout;
 	unsigned int data_timeout; // milliseconds
 	bool needs_flush;
-	unsigned int send_window; // In records
-	
-	// Register cache
+	unsigned int send_window; // In bytes
+
+	/*
+	 * Readout keeps several bulk transfers queued on the data endpoint
+	 * so that the device always has somewhere to send records. As each
+	 * completes its buffer is queued for the readout thread and the
+	 * transfer is resubmitted at once with a free buffer, leaving data_cb
+	 * off the path of the USB pipe. Transfers on an endpoint complete in
+	 * the order submitted, so buffers are handed on in order.
+	 */
+	struct readout_transfer {
+		timetagger* tt;
+		libusb_transfer* transfer;
+		uint8_t* buffer;	// NULL while waiting for a free buffer
+		bool queued;
+	};
+	struct readout_block {
+		uint8_t* buffer;
+		size_t length;
+	};
+	unsigned int n_transfers;
+	unsigned int transfer_size;	// In bytes
+	std::vector<readout_transfer> readout_xfers;
+	std::vector<uint8_t> readout_storage;
+	// Protects the following and readout_xfers
+	std::mutex readout_lock;
+	std::deque<readout_block> completed_blocks;	// In completion order
+	std::vector<uint8_t*> free_buffers;
+	unsigned int in_flight;
+	unsigned int failed_xfers;
+	// Start of a record split across transfers, used by the readout thread
+	uint8_t carry[RECORD_LENGTH];
+	size_t carry_len;
+
+	/*
+	 * Register cache, protected by reg_lock. It is updated by every
+	 * register command, including the status polls which may run on
+	 * another thread, so it is only read through cached_reg() or with
+	 * the lock held. The read-modify-write of a register by the set_*
+	 * methods is not atomic as a whole: these must be called from one
+	 * thread at a time.
+	 */
 	uint32_t regs[TIMETAG_NREGS];
+	// When the volatile registers were last read together
+	std::chrono::steady_clock::time_point status_time;
+
+	// Preallocated for register commands, a request and reply each
+	struct reg_buffer {
+		uint8_t cmd[8];
+		uint8_t reply[4];
+	};
+	std::mutex reg_lock;
+	std::vector<libusb_transfer*> reg_xfers;
+	std::vector<reg_buffer> reg_bufs;
 
 	uint32_t reg_cmd(bool write, uint16_t reg, uint32_t val);
 	uint32_t read_reg(uint16_t reg);
+	// The cached value of a register
+	uint32_t cached_reg(uint16_t reg);
+	// Read a volatile register or serve another from the cache
+	uint32_t get_reg(uint16_t reg);
 	void write_reg(uint16_t reg, uint32_t val);
 	void flush_fx2_fifo();
 	void readout_handler();
+	static void LIBUSB_CALL readout_cb(libusb_transfer* transfer);
+	bool submit_readout(readout_transfer& rt);
+	void cancel_readout();
+	void deliver_blocks();
 	void do_flush();
 
 public:
+	// A register command; val receives the register's value
+	struct reg_op {
+		bool write;
+		uint16_t reg;
+		uint32_t val;
+	};
+
+	// The device's state as of the last refresh_status()
+	struct status {
+		std::chrono::steady_clock::time_point time;
+		unsigned int version, clockrate, seq_clockrate;
+		bool capture_en;
+		uint32_t record_count, lost_record_count;
+		uint8_t strobe_operate, delta_operate;
+		bool seq_operate;
+		struct {
+			bool operate, initial_state;
+			uint32_t initial_count, low_count, high_count;
+		} seqchans[TIMETAG_NSEQCHANS];
+	};
+
 	data_cb_t data_cb;
 
 	timetagger(libusb_context* ctx, libusb_device_handle* dev, data_cb_t data_cb);
 	~timetagger();
 	
 	void set_send_window(unsigned int records);
+	void set_send_window_bytes(unsigned int bytes);
+	// These take effect at the next start_readout()
+	void set_readout_transfers(unsigned int n);
+	void set_readout_transfer_size(unsigned int bytes);
+	unsigned int get_readout_transfer_size() const { return transfer_size; }
+
+	// Execute many register commands in one pipelined exchange
+	void reg_cmds(reg_op* ops, size_t n);
+	// Refresh the cached values of the given registers
+	void read_regs(const uint16_t* addrs, size_t n);
+
+	// Read the volatile registers in one exchange
+	void refresh_status();
+	// Taken from the cache, without touching the device
+	status get_status();
 
 	unsigned int get_version();
 	unsigned int get_clockrate();
@@ -92,6 +194,8 @@ public:
 	bool get_global_sequencer_operate();
 	void reset_sequencer();
 	void set_seqchan_operate(unsigned int seq, bool operate);
+	void set_seqchan_config(unsigned int seq, bool initial_state, uint32_t initial_count,
+				uint32_t low_count, uint32_t high_count);
 	bool get_seqchan_operate(unsigned int seq);
 	void set_seqchan_initial_state(unsigned int seq, bool initial_state);
 	bool get_seqchan_initial_state(unsigned int seq);
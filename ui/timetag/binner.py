@@ -5,11 +5,18 @@ import numpy as np
 from time import time
 import os
 import subprocess
-from collections import defaultdict
 from ringbuffer import RingBuffer
 
 bin_dtype = np.dtype([('time', 'f'), ('counts', 'u4')])
 
+# Packed bin stream written by timetag_bin --packed
+packed_bin_header_fmt = '=4sIQII'
+packed_bin_dtype = np.dtype([('start_time', '=u8'), ('count', '=u4'), ('lost', '=u4'),
+                             ('chan', 'u1'), ('flags', 'u1'), ('length_idx', '=u2')])
+PACKED_BIN_VERSION = 1
+# Set in the flags of a record giving a run of empty bins (timetag_bin --zero-runs)
+PACKED_ZERO_RUN = 0x1
+
 class Binner(object):
     def __init__(self, bin_time, clockrate):
         self._bin_time = bin_time
@@ -18,8 +25,10 @@ class Binner(object):
         self.latest_timestamp = 0
         self.loss_count = 0
         
-        bin_length = int(bin_time * self.clockrate)
-        cmd = [os.path.join('timetag_bin'), str(bin_length)]
+        self.bin_length = int(bin_time * self.clockrate)
+        cmd = [os.path.join('timetag_bin'), '--packed', '--zero-runs',
+               '--clockrate', str(int(self.clockrate)),
+               '--flush-latency', '0.05', str(self.bin_length)]
         self._binner = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
         logging.info("Started process %s" % cmd)
 
@@ -35,82 +44,124 @@ class Binner(object):
         self._binner = None
         self.listener.join()
 
+    def _read_header(self, out):
+        header_sz = struct.calcsize(packed_bin_header_fmt)
+        magic, version, clockrate, n_lengths, record_sz = \
+            struct.unpack(packed_bin_header_fmt, out.read(header_sz))
+        if magic != 'TTBN' or version != PACKED_BIN_VERSION \
+           or record_sz != packed_bin_dtype.itemsize:
+            raise RuntimeError('Unsupported bin stream (version %d)' % version)
+        out.read(8 * n_lengths)
+
     def _listen(self):
-        bin_fmt = 'iQII'
-        bin_sz = struct.calcsize(bin_fmt)
+        out = self._binner.stdout
+        self._read_header(out)
+        record_sz = packed_bin_dtype.itemsize
+        pending = ''
         while True:
             if not self._binner: break
-            data = self._binner.stdout.read(bin_sz)
-            if len(data) != bin_sz: break
+            # Take whatever timetag_bin has written as one array
+            data = os.read(out.fileno(), 4096 * record_sz)
+            if len(data) == 0: break
             self.last_bin_walltime = time()
 
-            chan, start_time, count, lost = struct.unpack(bin_fmt, data)
-            self.loss_count += lost #FIXME: overcounting
-            self.latest_timestamp = start_time
-            self.handle_bin(chan, start_time, count, lost)
-
-    def handle_bin(self, channel, start_time, count, lost):
+            data = pending + data
+            n = len(data) // record_sz
+            pending = data[n*record_sz:]
+            if n == 0: continue
+            bins = np.frombuffer(data[:n*record_sz], dtype=packed_bin_dtype)
+            zero_run = (bins['flags'] & PACKED_ZERO_RUN) != 0
+
+            self.loss_count += int(bins['lost'][~zero_run].sum()) #FIXME: overcounting
+            last = bins[-1]
+            self.latest_timestamp = int(last['start_time'])
+            if zero_run[-1]:
+                self.latest_timestamp += (int(last['count']) - 1) * self.bin_length
+            self.handle_bins(bins, zero_run)
+
+    def handle_bins(self, bins, zero_run):
+        """ Handle a block of packed bins in stream order. The records
+        where zero_run is set give a run of count empty bins starting at
+        start_time. """
         pass
 
-class HistBinner(Binner):
+class HistAccumulator(object):
+    """ Accumulates histograms of bin counts with timetag_hist, keeping
+    the latest snapshot of them as arrays. """
+    def __init__(self, bin_time, clockrate, hist_width=1, count_bins=256,
+                 fret_bins=20, donor_channel=0, acceptor_channel=1, threshold=3,
+                 snapshot_time=0.25):
+        self.clockrate = clockrate
+        self.latest_timestamp = 0
+        self.count_bins = count_bins
+        self.fret_bins = fret_bins
+        self.count_hist = np.zeros((4, count_bins), dtype=np.uint64)
+        self.fret_hist = np.zeros(fret_bins, dtype=np.uint64)
+
+        cmd = ['timetag_hist',
+               '--hist-width', str(int(hist_width)),
+               '--count-bins', str(count_bins),
+               '--fret-bins', str(fret_bins),
+               '--donor', str(donor_channel),
+               '--acceptor', str(acceptor_channel),
+               '--threshold', str(int(threshold)),
+               '--snapshot-interval', str(int(snapshot_time * clockrate)),
+               str(int(bin_time * clockrate))]
+        self._hist = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        logging.info("Started process %s" % cmd)
+
+        self.listener = threading.Thread(name='Histogram Listener', target=self._listen)
+        self.listener.daemon = True
+        self.listener.start()
+
+    def get_data_fd(self):
+        return self._hist.stdin
+
+    def stop(self):
+        self._hist.terminate()
+        self._hist = None
+        self.listener.join()
+
+    def _listen(self):
+        n = self.count_bins
+        snapshot_sz = 8 * (1 + 4*n + self.fret_bins)
+        while True:
+            if not self._hist: break
+            data = self._hist.stdout.read(snapshot_sz)
+            if len(data) != snapshot_sz: break
+            snapshot = np.frombuffer(data, dtype=np.uint64)
+            self.latest_timestamp = snapshot[0]
+            self.count_hist = snapshot[1:1+4*n].reshape(4, n)
+            self.fret_hist = snapshot[1+4*n:]
+
+class HistBinner(HistAccumulator):
     def __init__(self, bin_time, clockrate, hist_width=10):
-        Binner.__init__(self, bin_time, clockrate)
-        self.hist_width = hist_width
+        self.hist_width = max(1, int(hist_width))
+        HistAccumulator.__init__(self, bin_time, clockrate, hist_width=self.hist_width)
 
     @property
-    def hist_width(self):
-        return self._hist_width
-
-    @hist_width.setter
-    def hist_width(self, width):
-        self._hist_width = width
-        # Reset histogram
-        self.channels = [defaultdict(lambda: 0) for c in range(4)]
-
-    def handle_bin(self, channel, start_time, count, lost):
-        c = self.channels[channel]
-        c[int(count / self.hist_width) * self.hist_width] += 1
-
-class FretHistBinner(Binner):
-    def __init__(self, bin_time, clockrate, hist_width=10,
-                 acceptor_channel=1, donor_channel=0):
-        Binner.__init__(self, bin_time, clockrate)
-        self.hist_width = hist_width
+    def channels(self):
+        """ The count histogram of each channel, keyed by the first count of each bin """
+        return [{i * self.hist_width: v for (i, v) in enumerate(h) if v > 0}
+                for h in self.count_hist]
+
+class FretHistBinner(HistAccumulator):
+    def __init__(self, bin_time, clockrate, hist_width=0.1,
+                 acceptor_channel=1, donor_channel=0, threshold=3):
+        fret_bins = max(1, int(round(1. / hist_width)))
+        self.hist_width = 1. / fret_bins
         self.acceptor_channel = acceptor_channel
         self.donor_channel = donor_channel
-        self.threshold = 3
-        self._last_donor_bin = None
-        self._last_acceptor_bin = None
+        self.threshold = threshold
+        HistAccumulator.__init__(self, bin_time, clockrate, fret_bins=fret_bins,
+                                 donor_channel=donor_channel,
+                                 acceptor_channel=acceptor_channel,
+                                 threshold=threshold)
 
     @property
-    def hist_width(self):
-        return self._hist_width
-
-    @hist_width.setter
-    def hist_width(self, width):
-        self._hist_width = width
-        self.reset_hist()
-
-    def reset_hist(self):
-        self.hist = defaultdict(lambda: 0)
-
-    def handle_bin(self, channel, start_time, count, lost):
-        if channel == self.donor_channel:
-            self._last_donor_bin = (start_time, count)
-        elif channel == self.acceptor_channel:
-            self._last_acceptor_bin = (start_time, count)
-        else:
-            return
-
-        if self._last_donor_bin is None or self._last_acceptor_bin is None: return
-        a_time, a_count = self._last_acceptor_bin
-        d_time, d_count = self._last_donor_bin
-
-        if d_time != a_time: return
-        if a_count + d_count < self.threshold: return
-        
-        fret_eff = 1. * a_count / (a_count + d_count)
-        self.hist[int(fret_eff / self.hist_width) * self.hist_width] += 1
+    def hist(self):
+        """ The FRET efficiency histogram, keyed by the lower edge of each bin """
+        return {i * self.hist_width: v for (i, v) in enumerate(self.fret_hist) if v > 0}
 
 class BufferBinner(Binner):
     class Channel(object):
@@ -134,11 +185,27 @@ class BufferBinner(Binner):
         for c in self.channels:
             c.resize(npts)
 
-    def handle_bin(self, channel, start_time, count, lost):
-        c = self.channels[channel]
-        start_time = 1.0*start_time / self.clockrate
-
-        with c._buffer_lock:
-            c.counts.append((start_time, count))
-            c.photon_count += count
-            c.latest_timestamp = start_time
+    def handle_bins(self, bins, zero_run):
+        for channel in np.unique(bins['chan']):
+            c = self.channels[channel]
+            sel = bins['chan'] == channel
+            b, z = bins[sel], zero_run[sel]
+            count = b['count'].astype(np.int64)
+
+            # Expand runs into empty bins, but only those which won't be
+            # pushed out of the buffer
+            size = c.counts._size
+            n = np.where(z, np.minimum(count, size), 1)
+            start = b['start_time'].astype(np.int64) + (count - n) * z * self.bin_length
+            rec = np.repeat(np.arange(len(b)), n)
+            offset = np.arange(len(rec)) - np.repeat(np.cumsum(n) - n, n)
+            rec, offset = rec[-size:], offset[-size:]
+
+            new = np.empty(len(rec), dtype=bin_dtype)
+            new['time'] = 1.0 * (start[rec] + offset * self.bin_length) / self.clockrate
+            new['counts'] = np.where(z, 0, count)[rec]
+
+            with c._buffer_lock:
+                c.counts.extend(new)
+                c.photon_count += int(count[~z].sum())
+                c.latest_timestamp = new['time'][-1]
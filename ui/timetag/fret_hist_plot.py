@@ -37,12 +37,11 @@ class FretHistPlot(ManagedBinner):
         def create_binner(self):
                 get_obj = self.builder.get_object
                 model = get_obj('channel_model')
-                binner = FretHistBinner(self.bin_time, self.pipeline.clockrate)
-                binner.donor_channel = model[get_obj('donor_combo').get_active_iter()][0]
-                binner.acceptor_channel = model[get_obj('acceptor_combo').get_active_iter()][0]
-                binner.threshold = get_obj('threshold').get_value()
-                binner.hist_width = 1. / get_obj('nbins').get_value()
-                return binner
+                return FretHistBinner(self.bin_time, self.pipeline.clockrate,
+                                      hist_width = 1. / get_obj('nbins').get_value(),
+                                      donor_channel = model[get_obj('donor_combo').get_active_iter()][0],
+                                      acceptor_channel = model[get_obj('acceptor_combo').get_active_iter()][0],
+                                      threshold = get_obj('threshold').get_value())
                 
         def on_started(self):
                 gobject.timeout_add(int(1000.0 / self.update_rate), self._update_plot,
@@ -46,6 +46,17 @@ class RingBuffer:
 			self._cur = 0
 			self.__class__ = RingBuffer.RingBufferFull
 
+        def extend(self, xs):
+                """ append an array of elements at the end of the buffer """
+                xs = xs[-self._size:]
+                end = self._cur + len(xs)
+                if end < self._size:
+                        self._data[self._cur:end] = xs
+                        self._cur = end
+                else:
+                        self.__class__ = RingBuffer.RingBufferFull
+                        self.extend(xs)
+
 	def get(self):
   		""" return a list of elements from the oldest to the newest"""
 		return self._data[:self._cur]
@@ -59,6 +70,11 @@ class RingBuffer:
                         self._data[self._cur] = x
                         self._cur = (self._cur+1) % self._size
 
+                def extend(self, xs):
+                        xs = xs[-self._size:]
+                        self._data[(self._cur + np.arange(len(xs))) % self._size] = xs
+                        self._cur = (self._cur + len(xs)) % self._size
+
                 def get(self):
                         return np.concatenate([self._data[self._cur:],
                                                self._data[:self._cur]])